@@ -7,13 +7,56 @@
 #include "../mmu/kheap.h"
 #include "../kstdlib/kstdlib.h"
 #include "../uart/debug.h"
+#ifdef KBENCH
+#include "../timer/timer.h"
+#endif
+
+//initial capacity of a line, doubled as it fills
+#define CONSOLE_LINE_MIN 32
+
+/*
+ * A line of the console
+ */
+typedef struct console_line_t {
+  char *str;
+  //characters in the line (excluding the null)
+  uint32_t len;
+  //bytes allocated for str
+  uint32_t cap;
+} console_line_t;
 
 //the size of the buffer
 uint8_t SCREEN_ROWS = 0;
 //the offset of the top line in the buffer
 uint8_t TOP_LINE = 0;
 //the console buffer
-char **CONSOLE_BUFFER = NULL;
+console_line_t *CONSOLE_BUFFER = NULL;
+
+/**
+ * Make room in a line, growing it geometrically so
+ * appends are amortized O(appended characters)
+ * @param  line the line
+ * @param  size the bytes needed (including the null)
+ * @return      0 on success, pos on error
+ */
+static uint8_t line_reserve(console_line_t *line, uint32_t size) {
+  if (size <= line->cap) {
+    return 0;
+  }
+
+  uint32_t cap = line->cap * 2;
+  if (cap < size) {
+    cap = size;
+  }
+  char *str = (char*) krealloc(line->str,cap);
+  if (!str) {
+    debug_err("console line allocation failed");
+    return 1;
+  }
+  line->str = str;
+  line->cap = cap;
+  return 0;
+}
 
 /**
  * Clear the screen and rerender lines
@@ -24,8 +67,11 @@ void render_screen() {
   //render the lines in the buffer
   for (int i=0; i<SCREEN_ROWS; i++) {
     //draw the line on the screen
-    draw_str(0,i * 10,CONSOLE_BUFFER[(TOP_LINE + i) % SCREEN_ROWS]);
+    draw_str(0,i * 10,CONSOLE_BUFFER[(TOP_LINE + i) % SCREEN_ROWS].str);
   }
+
+  //frame complete
+  display_flush();
 }
 
 /**
@@ -38,27 +84,35 @@ uint8_t init_console() {
   SCREEN_ROWS = DISPLAY_HEIGHT / 10;
 
   //init the console buffer
-  CONSOLE_BUFFER = (char**) kmalloc(SCREEN_ROWS * sizeof(char*));
+  CONSOLE_BUFFER = (console_line_t*) kmalloc(SCREEN_ROWS * sizeof(console_line_t));
 
   if (!CONSOLE_BUFFER) {
     debug_err("console buffer allocation failed");
     return 1;
   }
 
-  char *empty = "";
-
   //fill out the buffer to start
   for (int i=0; i<SCREEN_ROWS; i++) {
-    CONSOLE_BUFFER[i] = (char*) kmalloc(strlen(empty) + 1);
+    CONSOLE_BUFFER[i].str = (char*) kmalloc(CONSOLE_LINE_MIN);
 
-    if (!CONSOLE_BUFFER[i]) {
+    if (!CONSOLE_BUFFER[i].str) {
       debug_err("console buffer line allocation failed");
       return 1;
-    } else {
-      memcpy(CONSOLE_BUFFER[i],empty,strlen(empty));
     }
+    CONSOLE_BUFFER[i].str[0] = 0;
+    CONSOLE_BUFFER[i].len = 0;
+    CONSOLE_BUFFER[i].cap = CONSOLE_LINE_MIN;
   }
 
+#ifdef KBENCH
+  uint64_t start = get_sys_count();
+  for (int i=0; i<SCREEN_ROWS; i++) {
+    draw_str(0,i * 10,"the quick brown fox jumps over the lazy dog 0123456789");
+  }
+  display_flush();
+  debug_val("framebuffer bench us",ticks_to_us(get_sys_count() - start));
+#endif
+
   render_screen();
   return 0;
 }
@@ -69,20 +123,15 @@ uint8_t init_console() {
  */
 void write_str(const char* str) {
   //expand the current line
-  uint32_t exist_line_size = strlen(CONSOLE_BUFFER[TOP_LINE]) + 1;
-  uint32_t new_str_size = strlen(str) + 1;
-
-  char *prev = (char*) kmalloc(exist_line_size);
-  memcpy(prev,CONSOLE_BUFFER[TOP_LINE],exist_line_size);
-
-  //free the previous allocation
-  kfree(CONSOLE_BUFFER[TOP_LINE]);
+  console_line_t *line = &CONSOLE_BUFFER[TOP_LINE];
+  uint32_t len = strlen(str);
+  if (line_reserve(line,line->len + len + 1)) {
+    return;
+  }
 
-  //allocate space for entire string
-  CONSOLE_BUFFER[TOP_LINE] = (char*) kmalloc(exist_line_size + new_str_size);
-  memcpy(CONSOLE_BUFFER[TOP_LINE],prev,exist_line_size);
-  memcpy(CONSOLE_BUFFER[TOP_LINE] + exist_line_size,str,new_str_size);
-  kfree(prev);
+  //append after the existing characters
+  memcpy(line->str + line->len,str,len + 1);
+  line->len += len;
 
   render_screen();
 }
@@ -92,10 +141,14 @@ void write_str(const char* str) {
  * @param str the string
  */
 void write_strln(char *str) {
-  //free the previous line
-  kfree(CONSOLE_BUFFER[TOP_LINE]);
-  CONSOLE_BUFFER[TOP_LINE] = (char*) kmalloc(strlen(str)+1);
-  memcpy(CONSOLE_BUFFER[TOP_LINE],str,strlen(str));
+  //replace the previous line
+  console_line_t *line = &CONSOLE_BUFFER[TOP_LINE];
+  uint32_t len = strlen(str);
+  if (line_reserve(line,len + 1)) {
+    return;
+  }
+  memcpy(line->str,str,len + 1);
+  line->len = len;
 
   //set the next offset
   TOP_LINE = (TOP_LINE + 1) % SCREEN_ROWS;
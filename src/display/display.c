@@ -6,6 +6,7 @@
 #include "display.h"
 #include "../uart/debug.h"
 #include "../kstdlib/kstdlib.h"
+#include "../mmu/mmu.h"
 #include "font.h"
 
 #define MMIO_BASE       0x3F000000
@@ -23,6 +24,8 @@
 #define MBOX_CH_PROP    8
 
 /* tags */
+#define MBOX_TAG_GETARMMEM      0x10005
+#define MBOX_TAG_GETVCMEM       0x10006
 #define MBOX_TAG_SETPOWER       0x28001
 #define MBOX_TAG_SETCLKRATE     0x38002
 #define MBOX_TAG_LAST           0
@@ -62,6 +65,8 @@ typedef struct pixel_t {
  */
 uint32_t mbox_call(uint8_t channel) {
   unsigned int r = (((unsigned int)((unsigned long)&MBOX)&~0xF) | (channel&0xF));
+  /* the gpu reads the message from memory, not the cache */
+  dcache_flush_range((void*)MBOX,sizeof(MBOX));
   /* wait until we can write to the mailbox */
   do{asm volatile("nop");}while(*MBOX_STATUS & MBOX_FULL);
   /* write the address of our message to the mailbox with channel identifier */
@@ -71,13 +76,55 @@ uint32_t mbox_call(uint8_t channel) {
       /* is there a response? */
       do{asm volatile("nop");}while(*MBOX_STATUS & MBOX_EMPTY);
       /* is it a response to our message? */
-      if(r == *MBOX_READ)
+      if(r == *MBOX_READ) {
+          /* drop stale lines so the response is read from memory */
+          dcache_flush_range((void*)MBOX,sizeof(MBOX));
           /* is it a valid successful response? */
           return MBOX[1]==MBOX_RESPONSE;
+      }
   }
   return 0;
 }
 
+/**
+ * Query the memory split between the ARM and the VideoCore
+ * @param  arm_base base address of ARM memory (returned)
+ * @param  arm_size size of ARM memory (returned)
+ * @param  vc_base  base address of VideoCore memory (returned)
+ * @param  vc_size  size of VideoCore memory (returned)
+ * @return          0 on success, pos on error
+ */
+uint8_t mbox_get_memory(uint32_t *arm_base,
+                        uint32_t *arm_size,
+                        uint32_t *vc_base,
+                        uint32_t *vc_size) {
+  MBOX[0] = 13*4;
+  MBOX[1] = MBOX_REQUEST;
+
+  MBOX[2] = MBOX_TAG_GETARMMEM;
+  MBOX[3] = 8;
+  MBOX[4] = 0;
+  MBOX[5] = 0;            //base
+  MBOX[6] = 0;            //size
+
+  MBOX[7] = MBOX_TAG_GETVCMEM;
+  MBOX[8] = 8;
+  MBOX[9] = 0;
+  MBOX[10] = 0;           //base
+  MBOX[11] = 0;           //size
+
+  MBOX[12] = MBOX_TAG_LAST;
+
+  if (mbox_call(MBOX_CH_PROP) && MBOX[6]!=0) {
+    *arm_base = MBOX[5];
+    *arm_size = MBOX[6];
+    *vc_base = MBOX[10];
+    *vc_size = MBOX[11];
+    return 0;
+  }
+  return 1;
+}
+
 /**
  * Initialize the display
  * SOURCE: https://github.com/bztsrc/raspi3-tutorial/blob/master/09_framebuffer/lfb.c
@@ -136,6 +183,17 @@ void init_display() {
     PITCH=MBOX[33];         //get number of bytes per line
     ISRGB=MBOX[24];         //get the actual channel order
     FB_ADDR=(void*)((unsigned long)MBOX[28]);
+    //the gpu scans out of memory, keep framebuffer writes out of the
+    //cache but let the write buffer merge them into bursts (it sits in
+    //videocore memory outside the ram map, so no lines to flush first)
+    if (mmu_map_region((uint64_t)FB_ADDR,(uint64_t)FB_ADDR,
+                       MBOX[29],MMU_WC | MMU_BLOCK)) {
+      debug_err("unable to map framebuffer");
+    }
+    //never hand the framebuffer out as a page
+    if (palloc_reserve((uint64_t)FB_ADDR,MBOX[29])) {
+      debug_err("unable to reserve framebuffer pages");
+    }
     debug_log("set screen resolution");
     debug_val("width",WIDTH);
     debug_val("height",HEIGHT);
@@ -171,6 +229,14 @@ void draw_char(unsigned char ch, int x, int y, unsigned char attr) {
   }
 }
 
+/**
+ * Drain buffered framebuffer writes
+ * Call once a frame has been drawn
+ */
+void display_flush() {
+  asm volatile("dsb st" ::: "memory");
+}
+
 /**
  * Clear the screen
  */
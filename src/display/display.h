@@ -11,11 +11,30 @@
 #define DISPLAY_WIDTH 512
 #define DISPLAY_HEIGHT 384
 
+/**
+ * Query the memory split between the ARM and the VideoCore
+ * @param  arm_base base address of ARM memory (returned)
+ * @param  arm_size size of ARM memory (returned)
+ * @param  vc_base  base address of VideoCore memory (returned)
+ * @param  vc_size  size of VideoCore memory (returned)
+ * @return          0 on success, pos on error
+ */
+uint8_t mbox_get_memory(uint32_t *arm_base,
+                        uint32_t *arm_size,
+                        uint32_t *vc_base,
+                        uint32_t *vc_size);
+
 /**
  * Initialize the display
  */
 void init_display();
 
+/**
+ * Drain buffered framebuffer writes
+ * Call once a frame has been drawn
+ */
+void display_flush();
+
 /**
  * Clear the screen
  */
@@ -9,17 +9,41 @@
 #include "schd/kschd.h"
 #include "schd/kproc.h"
 #include "display/console.h"
+#include "display/display.h"
 #include "shell/shell.h"
+#include "timer/timer.h"
+#include "irq/irq.h"
+#ifdef KBENCH
+#include "mmu/kbench.h"
+#include "schd/kschd_bench.h"
+#endif
 #include <stdnoreturn.h>
 #include <stdint.h>
 #include <stddef.h>
 
+//ARM memory if the firmware cannot be queried (1GB less 64MB for the gpu)
+#define DEFAULT_PHY_SIZE 0x3C000000
+
+#ifdef KBENCH
+//allocator benchmark operations per run
+#define KBENCH_OPS 200000
+//scheduler benchmark window
+#define KBENCH_SCHD_MS 2000
+#endif
+
 /**
  * The init process scheduled on startup to complete the
  * rest of the init process
  * @return status
  */
 int schd_init_proc(int argc,char *argv[]) {
+#ifdef KBENCH
+  //scheduler fairness needs running threads (compare with make CFS=1)
+  if (kbench_kschd(KBENCH_SCHD_MS)) {
+    debug_err("kbench failed");
+  }
+#endif
+
   debug_log("init display and console");
 
   if (init_console() == 0) {
@@ -35,7 +59,10 @@ int schd_init_proc(int argc,char *argv[]) {
     debug_val("exit code",WEXITSTAT(stat));
   }
 
-  while (1) {}
+  //init never exits, block rather than spin (nothing wakes it)
+  while (1) {
+    set_curr_proc_state(PROC_WAITING);
+  }
   return -1;
 }
 
@@ -48,11 +75,32 @@ noreturn void init() {
   init_uart();
   debug_log("init");
 
+  //report faults instead of hanging silently (irqs stay masked)
+  init_irq();
+
+  //start the cycle counter for allocator telemetry
+  init_cycle_count();
+
   //initialize memory mgmt
   debug_log("init mmu");
 
   //the start of the kernel heap
-  uint64_t kheap_start = init_mmu(1024 * 1024 * 1024);
+  //ask the firmware how much memory belongs to the ARM
+  uint64_t phy_size = DEFAULT_PHY_SIZE;
+  uint32_t arm_base, arm_size, vc_base, vc_size;
+  if (mbox_get_memory(&arm_base,&arm_size,&vc_base,&vc_size) == 0) {
+    phy_size = (uint64_t) arm_base + arm_size;
+    debug_val("arm memory base",arm_base);
+    debug_val("arm memory size",arm_size);
+    debug_val("vc memory base",vc_base);
+    debug_val("vc memory size",vc_size);
+  } else {
+    debug_err("unable to query memory split");
+  }
+
+  uint64_t mmu_start = get_sys_count();
+  uint64_t kheap_start = init_mmu(phy_size);
+  debug_val("init_mmu us",ticks_to_us(get_sys_count() - mmu_start));
   if (kheap_start <= 0) {
     debug_err("init_mmu failed");
   } else {
@@ -60,6 +108,28 @@ noreturn void init() {
     debug_log("init kheap");
     init_kheap(kheap_start,K_HEAP_SIZE_B);
 
+#ifdef KBENCH
+    //locks are plain flags until mmu_enable(), no exclusives on
+    //uncached memory
+    debug_log("kbench (mmu off)");
+    if (kbench_kheap(KBENCH_OPS,1)) {
+      debug_err("kbench failed");
+    }
+#endif
+
+    //enable translation and caches
+    debug_log("enable mmu");
+    if (mmu_enable(phy_size) != 0) {
+      debug_err("mmu_enable failed");
+    }
+
+#ifdef KBENCH
+    debug_log("kbench (mmu on)");
+    if (kbench_kheap(KBENCH_OPS,1) || kbench_palloc(KBENCH_OPS,1)) {
+      debug_err("kbench failed");
+    }
+#endif
+
     //initialize the kernel process scheduler
     debug_log("init kschd");
     init_kschd();
@@ -0,0 +1,126 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "irq.h"
+#include "../timer/timer.h"
+#include "../schd/kschd.h"
+#include "../uart/debug.h"
+#include "../smp/smp.h"
+
+//per core irq source (BCM2836 local peripherals, 4 bytes per core)
+#define CORE0_IRQ_SOURCE 0x40000060
+//non-secure physical timer (CNTPNSIRQ)
+#define IRQ_SRC_CNTPNS   (1 << 1)
+//mailbox 0, used to wake a core from wfi
+#define IRQ_SRC_MBOX0    (1 << 4)
+
+//per core mailbox irq control (bit n routes mailbox n to irq)
+#define CORE0_MBOX_IRQCNTL 0x40000050
+//per core mailbox 0 write-set and read/write-clear (16 bytes per core)
+#define CORE0_MBOX0_SET    0x40000080
+#define CORE0_MBOX0_CLR    0x400000C0
+
+//set the vector table, defined in vectors.S
+void init_vectors();
+
+//names of the vector table entries
+static const char *EXCEPTION_NAMES[] = {
+  "SYNC_EL1t", "IRQ_EL1t", "FIQ_EL1t", "ERROR_EL1t",
+  "SYNC_EL1h", "IRQ_EL1h", "FIQ_EL1h", "ERROR_EL1h",
+  "SYNC_EL0_64", "IRQ_EL0_64", "FIQ_EL0_64", "ERROR_EL0_64",
+  "SYNC_EL0_32", "IRQ_EL0_32", "FIQ_EL0_32", "ERROR_EL0_32"
+};
+
+/**
+ * Install the exception vector table (VBAR_EL1) and route this
+ * core's wakeup mailbox to irq
+ * Interrupts stay masked until enable_irq()
+ */
+void init_irq() {
+  init_vectors();
+  uint64_t reg = CORE0_MBOX_IRQCNTL + (4 * get_core_id());
+  *(volatile uint32_t*) reg = 1;
+}
+
+/**
+ * Unmask irqs on this core
+ */
+void enable_irq() {
+  asm volatile("msr daifclr, #2" ::: "memory");
+}
+
+/**
+ * Mask irqs on this core
+ */
+void disable_irq() {
+  asm volatile("msr daifset, #2" ::: "memory");
+}
+
+/**
+ * Mask irqs on this core
+ * @return the previous irq state (for irq_restore)
+ */
+uint64_t irq_save() {
+  uint64_t flags;
+  asm volatile("mrs %0, daif\n"
+               "msr daifset, #2" : "=r"(flags) :: "memory");
+  return flags;
+}
+
+/**
+ * Restore the irq state saved by irq_save()
+ * @param flags the saved state
+ */
+void irq_restore(uint64_t flags) {
+  asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+/**
+ * Interrupt another core so it leaves wfi (mailbox 0)
+ * @param core the core id
+ */
+void irq_send_wakeup(uint8_t core) {
+  //the waker's stores are visible before the irq is
+  asm volatile("dsb sy" ::: "memory");
+  uint64_t reg = CORE0_MBOX0_SET + (16 * core);
+  *(volatile uint32_t*) reg = 1;
+}
+
+/**
+ * Irq handler, called from the vector table with the
+ * interrupted register frame saved
+ */
+void handle_irq() {
+  uint64_t reg = CORE0_IRQ_SOURCE + (4 * get_core_id());
+  uint32_t source = *(volatile uint32_t*) reg;
+
+  if (source & IRQ_SRC_MBOX0) {
+    //leaving wfi was the point, the idle loop rechecks its queue
+    reg = CORE0_MBOX0_CLR + (16 * get_core_id());
+    *(volatile uint32_t*) reg = 0xFFFFFFFF;
+  }
+  if (source & IRQ_SRC_CNTPNS) {
+    //rearm before preempting, the switch may not return for a while
+    timer_preempt(timer_tick_ack());
+  } else if (!(source & IRQ_SRC_MBOX0)) {
+    debug_val("unhandled irq source",source);
+  }
+}
+
+/**
+ * Report an unexpected exception (does not return to the caller)
+ * @param type the vector table entry taken
+ * @param esr  exception syndrome
+ * @param elr  exception link (faulting pc)
+ * @param far  fault address
+ */
+void handle_bad_exception(uint64_t type,
+                          uint64_t esr,
+                          uint64_t elr,
+                          uint64_t far) {
+  debug_err(EXCEPTION_NAMES[type & 0xF]);
+  debug_val("esr",esr);
+  debug_val("elr",elr);
+  debug_val("far",far);
+}
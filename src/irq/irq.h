@@ -0,0 +1,64 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _IRQ_IRQ_H
+#define _IRQ_IRQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Install the exception vector table (VBAR_EL1) and route this
+ * core's wakeup mailbox to irq
+ * Interrupts stay masked until enable_irq()
+ */
+void init_irq();
+
+/**
+ * Unmask irqs on this core
+ */
+void enable_irq();
+
+/**
+ * Mask irqs on this core
+ */
+void disable_irq();
+
+/**
+ * Mask irqs on this core
+ * @return the previous irq state (for irq_restore)
+ */
+uint64_t irq_save();
+
+/**
+ * Restore the irq state saved by irq_save()
+ * @param flags the saved state
+ */
+void irq_restore(uint64_t flags);
+
+/**
+ * Interrupt another core so it leaves wfi (mailbox 0)
+ * @param core the core id
+ */
+void irq_send_wakeup(uint8_t core);
+
+/**
+ * Irq handler, called from the vector table with the
+ * interrupted register frame saved
+ */
+void handle_irq();
+
+/**
+ * Report an unexpected exception (does not return to the caller)
+ * @param type the vector table entry taken
+ * @param esr  exception syndrome
+ * @param elr  exception link (faulting pc)
+ * @param far  fault address
+ */
+void handle_bad_exception(uint64_t type,
+                          uint64_t esr,
+                          uint64_t elr,
+                          uint64_t far);
+
+#endif /*_IRQ_IRQ_H*/
@@ -32,3 +32,42 @@ uint32_t strlen(const char *str) {
   }
   return size;
 }
+
+/**
+ * Compare two strings
+ * @param  a the first null term string
+ * @param  b the second null term string
+ * @return   0 if equal, neg if a sorts first, pos otherwise
+ */
+int strcmp(const char *a, const char *b) {
+  while ((*a != 0) && (*a == *b)) {
+    a++;
+    b++;
+  }
+  return (int) (uint8_t) *a - (int) (uint8_t) *b;
+}
+
+/**
+ * Parse an unsigned decimal number
+ * @param  str the null term string (digits only)
+ * @param  val the number (set on success)
+ * @return     0 on success, pos if empty, not a number or too large
+ */
+uint8_t strtou(const char *str, uint64_t *val) {
+  if (*str == 0) {
+    return 1;
+  }
+  uint64_t num = 0;
+  for (; *str != 0; str++) {
+    if ((*str < '0') || (*str > '9')) {
+      return 1;
+    }
+    uint64_t digit = *str - '0';
+    if (num > ((uint64_t) -1 - digit) / 10) {
+      return 1;
+    }
+    num = (num * 10) + digit;
+  }
+  *val = num;
+  return 0;
+}
@@ -24,4 +24,20 @@ void memcpy(void *dest, const void *src, uint32_t bytes);
  */
 uint32_t strlen(const char *str);
 
+/**
+ * Compare two strings
+ * @param  a the first null term string
+ * @param  b the second null term string
+ * @return   0 if equal, neg if a sorts first, pos otherwise
+ */
+int strcmp(const char *a, const char *b);
+
+/**
+ * Parse an unsigned decimal number
+ * @param  str the null term string (digits only)
+ * @param  val the number (set on success)
+ * @return     0 on success, pos if empty, not a number or too large
+ */
+uint8_t strtou(const char *str, uint64_t *val);
+
 #endif /*_KSTDLIB_KSTDLIB_H*/
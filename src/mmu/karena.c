@@ -0,0 +1,141 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "karena.h"
+#include "mmu.h"
+#include "../uart/debug.h"
+
+//allocations are aligned to 16 bytes
+#define ARENA_ALIGN 16
+
+/*
+ * A chunk of pages, with this header at the start
+ */
+typedef struct karena_chunk_t {
+  struct karena_chunk_t* next;
+  //the page order of the chunk
+  uint8_t order;
+} __attribute__((aligned(ARENA_ALIGN))) karena_chunk_t;
+
+struct karena_t {
+  //chunks, most recent first (the arena lives in the last one)
+  karena_chunk_t* chunks;
+  //the next free byte in the current chunk
+  uint64_t curr;
+  //the end of the current chunk
+  uint64_t end;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+/**
+ * Allocate a chunk of 2^order pages
+ * @param  order the page order
+ * @return       the chunk, NULL on error
+ */
+static karena_chunk_t* chunk_alloc(uint8_t order) {
+  //chunk memory is handed out uncleared
+  karena_chunk_t *chunk = (karena_chunk_t*) (order == 0 ?
+                                              palloc_nozero() :
+                                              palloc_order_nozero(order));
+  if (chunk != NULL) {
+    chunk->next = NULL;
+    chunk->order = order;
+  }
+  return chunk;
+}
+
+/**
+ * Free a chunk
+ * @param chunk the chunk
+ */
+static void chunk_free(karena_chunk_t *chunk) {
+  if (chunk->order == 0) {
+    pfree(chunk);
+  } else {
+    pfree_order(chunk,chunk->order);
+  }
+}
+
+/**
+ * Create an arena
+ * @return the arena, NULL on error
+ */
+karena_t* karena_create() {
+  karena_chunk_t *chunk = chunk_alloc(0);
+  if (chunk == NULL) {
+    return NULL;
+  }
+
+  //the arena is stored in its first chunk
+  karena_t *arena = (karena_t*) (chunk + 1);
+  arena->chunks = chunk;
+  arena->curr = (uint64_t) (arena + 1);
+  arena->end = (uint64_t) chunk + PAGE_SIZE_B;
+  return arena;
+}
+
+/**
+ * Allocate from an arena (16 byte aligned, not cleared)
+ * @param  arena the arena
+ * @param  size  the size of the allocation
+ * @return       the allocation, NULL on error
+ */
+void* karena_alloc(karena_t *arena, uint64_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(uint64_t)(ARENA_ALIGN - 1);
+
+  //fast path, bump the pointer
+  if ((arena->end - arena->curr) >= size) {
+    void *memory = (void*) arena->curr;
+    arena->curr += size;
+    return memory;
+  }
+
+  //start a new chunk large enough for the allocation
+  uint8_t order = 0;
+  while ((((uint64_t) PAGE_SIZE_B << order) - sizeof(karena_chunk_t)) < size) {
+    order++;
+  }
+
+  karena_chunk_t *chunk = chunk_alloc(order);
+  if (chunk == NULL) {
+    debug_log("karena out of pages");
+    return NULL;
+  }
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->curr = (uint64_t) (chunk + 1) + size;
+  arena->end = (uint64_t) chunk + ((uint64_t) PAGE_SIZE_B << order);
+  return chunk + 1;
+}
+
+/**
+ * Free every allocation in an arena, keeping its first chunk
+ * @param arena the arena
+ */
+void karena_reset(karena_t *arena) {
+  //the first chunk holds the arena itself
+  karena_chunk_t *first = ((karena_chunk_t*) arena) - 1;
+
+  karena_chunk_t *chunk = arena->chunks;
+  while (chunk != first) {
+    karena_chunk_t *next = chunk->next;
+    chunk_free(chunk);
+    chunk = next;
+  }
+
+  arena->chunks = first;
+  arena->curr = (uint64_t) (arena + 1);
+  arena->end = (uint64_t) first + PAGE_SIZE_B;
+}
+
+/**
+ * Free an arena and every allocation in it
+ * @param arena the arena
+ */
+void karena_destroy(karena_t *arena) {
+  if (arena == NULL) {
+    return;
+  }
+  karena_reset(arena);
+  chunk_free(arena->chunks);
+}
@@ -0,0 +1,43 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _MMU_KARENA_H
+#define _MMU_KARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A bump allocator over page chunks
+ * Allocations are freed all at once by reset or destroy
+ */
+typedef struct karena_t karena_t;
+
+/**
+ * Create an arena
+ * @return the arena, NULL on error
+ */
+karena_t* karena_create();
+
+/**
+ * Allocate from an arena (16 byte aligned, not cleared)
+ * @param  arena the arena
+ * @param  size  the size of the allocation
+ * @return       the allocation, NULL on error
+ */
+void* karena_alloc(karena_t *arena, uint64_t size);
+
+/**
+ * Free every allocation in an arena, keeping its first chunk
+ * @param arena the arena
+ */
+void karena_reset(karena_t *arena);
+
+/**
+ * Free an arena and every allocation in it
+ * @param arena the arena
+ */
+void karena_destroy(karena_t *arena);
+
+#endif /*_MMU_KARENA_H*/
@@ -0,0 +1,300 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifdef KBENCH
+
+#include "kbench.h"
+#include "kheap.h"
+#include "mmu.h"
+#include "../timer/timer.h"
+#include "../uart/debug.h"
+
+//live allocations at any time
+#define KBENCH_SLOTS 256
+//latency samples kept per operation type (most recent)
+#define KBENCH_SAMPLES 4096
+//page order of a sample buffer (KBENCH_SAMPLES * 8 bytes)
+#define KBENCH_SAMPLES_ORDER 3
+//fragmentation snapshots per kheap run
+#define KBENCH_TRACE_POINTS 8
+//largest kmalloc size as a power of two
+#define KBENCH_KHEAP_MAX_SHIFT 12
+//largest palloc order
+#define KBENCH_PALLOC_MAX_ORDER 3
+
+void* KBENCH_ALLOCS[KBENCH_SLOTS];
+uint64_t KBENCH_SIZES[KBENCH_SLOTS];
+
+/*
+ * Latency samples for one operation type
+ */
+typedef struct kbench_lat_t {
+  uint64_t* samples;
+  uint64_t count;
+} kbench_lat_t;
+
+/**
+ * Next value from a xorshift generator
+ * @param  state the generator state (updated)
+ * @return       the value
+ */
+static uint64_t bench_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+/**
+ * Record a latency sample
+ * @param lat    the samples
+ * @param cycles the latency in cycles
+ */
+static void lat_add(kbench_lat_t *lat, uint64_t cycles) {
+  lat->samples[lat->count % KBENCH_SAMPLES] = cycles;
+  lat->count++;
+}
+
+/**
+ * Sort latency samples (shell sort, no recursion)
+ * @param samples the samples
+ * @param n       the number of samples
+ */
+static void lat_sort(uint64_t *samples, uint64_t n) {
+  for (uint64_t gap=n / 2; gap>0; gap/=2) {
+    for (uint64_t i=gap; i<n; i++) {
+      uint64_t val = samples[i];
+      uint64_t j = i;
+      while ((j >= gap) && (samples[j - gap] > val)) {
+        samples[j] = samples[j - gap];
+        j -= gap;
+      }
+      samples[j] = val;
+    }
+  }
+}
+
+/**
+ * Log latency percentiles
+ * @param name the operation
+ * @param lat  the samples
+ */
+static void lat_report(const char* name, kbench_lat_t *lat) {
+  uint64_t n = lat->count < KBENCH_SAMPLES ? lat->count : KBENCH_SAMPLES;
+  debug_val(name,lat->count);
+  if (n == 0) {
+    return;
+  }
+  lat_sort(lat->samples,n);
+  debug_val(" p50 cycles",lat->samples[n / 2]);
+  debug_val(" p99 cycles",lat->samples[(n * 99) / 100]);
+  debug_val(" max cycles",lat->samples[n - 1]);
+}
+
+/**
+ * Log throughput
+ * @param ops   the number of operations
+ * @param ticks the system counter ticks taken
+ */
+static void ops_report(uint64_t ops, uint64_t ticks) {
+  uint64_t us = ticks_to_us(ticks);
+  debug_val("bench us",us);
+  if (us > 0) {
+    debug_val("bench ops/sec",(ops * 1000000) / us);
+  }
+}
+
+/**
+ * Allocate sample buffers
+ * @param  alloc_lat the allocation samples (set)
+ * @param  free_lat  the free samples (set)
+ * @return           0 on success, pos on error
+ */
+static uint8_t lat_init(kbench_lat_t *alloc_lat, kbench_lat_t *free_lat) {
+  alloc_lat->samples = (uint64_t*) palloc_order(KBENCH_SAMPLES_ORDER);
+  free_lat->samples = (uint64_t*) palloc_order(KBENCH_SAMPLES_ORDER);
+  alloc_lat->count = 0;
+  free_lat->count = 0;
+  if ((alloc_lat->samples == NULL) || (free_lat->samples == NULL)) {
+    pfree_order(alloc_lat->samples,KBENCH_SAMPLES_ORDER);
+    pfree_order(free_lat->samples,KBENCH_SAMPLES_ORDER);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Free sample buffers
+ * @param alloc_lat the allocation samples
+ * @param free_lat  the free samples
+ */
+static void lat_free(kbench_lat_t *alloc_lat, kbench_lat_t *free_lat) {
+  pfree_order(alloc_lat->samples,KBENCH_SAMPLES_ORDER);
+  pfree_order(free_lat->samples,KBENCH_SAMPLES_ORDER);
+}
+
+/**
+ * Log a heap fragmentation snapshot
+ * @param op the operation number
+ */
+static void kheap_trace(uint64_t op) {
+  kheap_stats_t stats;
+  kheap_get_stats(&stats);
+  debug_val("trace op",op);
+  debug_val(" live",stats.live);
+  debug_val(" cap",stats.cap);
+  debug_val(" free_blocks",stats.free_blocks);
+  debug_val(" largest_free",stats.largest_free);
+  debug_val(" frag_pct",stats.frag_pct);
+}
+
+/**
+ * Check and free a kmalloc slot
+ * @param  slot the slot
+ * @param  lat  the free samples
+ * @return      0 if the allocation was intact, pos otherwise
+ */
+static uint8_t kheap_slot_free(uint64_t slot, kbench_lat_t *lat) {
+  uint8_t *memory = (uint8_t*) KBENCH_ALLOCS[slot];
+  uint64_t size = KBENCH_SIZES[slot];
+  uint8_t status = 0;
+  for (uint64_t i=0; i<size; i++) {
+    if (memory[i] != (uint8_t) slot) {
+      status = 1;
+      break;
+    }
+  }
+
+  uint64_t start = get_cycle_count();
+  kfree(memory);
+  lat_add(lat,get_cycle_count() - start);
+  KBENCH_ALLOCS[slot] = NULL;
+  return status;
+}
+
+/**
+ * Run randomized kmalloc/kfree traffic, checking each allocation
+ * is intact when freed, and log throughput, latency percentiles
+ * and a fragmentation trace
+ * @param  ops  the number of operations
+ * @param  seed the random seed (non zero)
+ * @return      0 on success, pos if an allocation was corrupted or failed
+ */
+uint8_t kbench_kheap(uint64_t ops, uint64_t seed) {
+  kbench_lat_t alloc_lat, free_lat;
+  if (lat_init(&alloc_lat,&free_lat)) {
+    return 1;
+  }
+  for (int i=0; i<KBENCH_SLOTS; i++) {
+    KBENCH_ALLOCS[i] = NULL;
+  }
+
+  debug_log("kbench kheap");
+  uint64_t errors = 0;
+  uint64_t ticks = 0;
+
+  for (uint64_t op=0; op<ops; op++) {
+    if ((op % (ops / KBENCH_TRACE_POINTS + 1)) == 0) {
+      kheap_trace(op);
+    }
+
+    uint64_t slot = bench_rand(&seed) % KBENCH_SLOTS;
+    uint64_t start = get_sys_count();
+
+    if (KBENCH_ALLOCS[slot] != NULL) {
+      errors += kheap_slot_free(slot,&free_lat);
+    } else {
+      //sizes spread evenly over powers of two
+      uint64_t shift = bench_rand(&seed) % (KBENCH_KHEAP_MAX_SHIFT + 1);
+      uint64_t size = 1 + (bench_rand(&seed) % (1UL << shift));
+
+      uint64_t cycles = get_cycle_count();
+      uint8_t *memory = (uint8_t*) kmalloc(size);
+      lat_add(&alloc_lat,get_cycle_count() - cycles);
+
+      if (memory == NULL) {
+        errors++;
+      } else {
+        memset(memory,(uint8_t) slot,size);
+        KBENCH_ALLOCS[slot] = memory;
+        KBENCH_SIZES[slot] = size;
+      }
+    }
+    ticks += get_sys_count() - start;
+  }
+  kheap_trace(ops);
+
+  for (uint64_t slot=0; slot<KBENCH_SLOTS; slot++) {
+    if (KBENCH_ALLOCS[slot] != NULL) {
+      errors += kheap_slot_free(slot,&free_lat);
+    }
+  }
+
+  ops_report(ops,ticks);
+  lat_report("kmalloc",&alloc_lat);
+  lat_report("kfree",&free_lat);
+  debug_val("kbench kheap errors",errors);
+  lat_free(&alloc_lat,&free_lat);
+  return errors > 0;
+}
+
+/**
+ * Run randomized palloc_order/pfree_order traffic and log
+ * throughput and latency percentiles
+ * @param  ops  the number of operations
+ * @param  seed the random seed (non zero)
+ * @return      0 on success, pos if an allocation failed
+ */
+uint8_t kbench_palloc(uint64_t ops, uint64_t seed) {
+  kbench_lat_t alloc_lat, free_lat;
+  if (lat_init(&alloc_lat,&free_lat)) {
+    return 1;
+  }
+  for (int i=0; i<KBENCH_SLOTS; i++) {
+    KBENCH_ALLOCS[i] = NULL;
+  }
+
+  debug_log("kbench palloc");
+  uint64_t errors = 0;
+  uint64_t ticks = 0;
+
+  for (uint64_t op=0; op<ops; op++) {
+    uint64_t slot = bench_rand(&seed) % KBENCH_SLOTS;
+    uint64_t start = get_sys_count();
+
+    if (KBENCH_ALLOCS[slot] != NULL) {
+      uint64_t cycles = get_cycle_count();
+      pfree_order(KBENCH_ALLOCS[slot],KBENCH_SIZES[slot]);
+      lat_add(&free_lat,get_cycle_count() - cycles);
+      KBENCH_ALLOCS[slot] = NULL;
+    } else {
+      uint8_t order = bench_rand(&seed) % (KBENCH_PALLOC_MAX_ORDER + 1);
+
+      uint64_t cycles = get_cycle_count();
+      KBENCH_ALLOCS[slot] = palloc_order(order);
+      lat_add(&alloc_lat,get_cycle_count() - cycles);
+
+      KBENCH_SIZES[slot] = order;
+      if (KBENCH_ALLOCS[slot] == NULL) {
+        errors++;
+      }
+    }
+    ticks += get_sys_count() - start;
+  }
+
+  for (uint64_t slot=0; slot<KBENCH_SLOTS; slot++) {
+    pfree_order(KBENCH_ALLOCS[slot],KBENCH_SIZES[slot]);
+  }
+
+  ops_report(ops,ticks);
+  lat_report("palloc_order",&alloc_lat);
+  lat_report("pfree_order",&free_lat);
+  debug_val("kbench palloc errors",errors);
+  lat_free(&alloc_lat,&free_lat);
+  return errors > 0;
+}
+
+#endif
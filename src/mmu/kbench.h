@@ -0,0 +1,35 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _MMU_KBENCH_H
+#define _MMU_KBENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Allocator stress tests and benchmarks (make KBENCH=1)
+ * Results are logged over uart
+ */
+
+/**
+ * Run randomized kmalloc/kfree traffic, checking each allocation
+ * is intact when freed, and log throughput, latency percentiles
+ * and a fragmentation trace
+ * @param  ops  the number of operations
+ * @param  seed the random seed (non zero)
+ * @return      0 on success, pos if an allocation was corrupted or failed
+ */
+uint8_t kbench_kheap(uint64_t ops, uint64_t seed);
+
+/**
+ * Run randomized palloc_order/pfree_order traffic and log
+ * throughput and latency percentiles
+ * @param  ops  the number of operations
+ * @param  seed the random seed (non zero)
+ * @return      0 on success, pos if an allocation failed
+ */
+uint8_t kbench_palloc(uint64_t ops, uint64_t seed);
+
+#endif /*_MMU_KBENCH_H*/
@@ -4,132 +4,567 @@
 
 #include "kheap.h"
 #include "../uart/debug.h"
+#include "../kstdlib/kstdlib.h"
 #include "mmu.h"
-
-//allocation flags
-#define FLAG_ALLOCATED 0x80
-
-//allocations must be 8 bytes minimum
-#define MIN_ALLOC_SIZE 8
+#include "../timer/timer.h"
+#include "../smp/spinlock.h"
+#include "../irq/irq.h"
+
+//allocation flags (low bits of the block size)
+#define FLAG_ALLOCATED      0x1
+#define FLAG_PREV_ALLOCATED 0x2
+#define FLAG_LARGE          0x4
+#define FLAG_MASK           0xF
+
+//allocations must be 16 bytes minimum (room for the free list links)
+#define MIN_ALLOC_SIZE 16
+//allocation sizes are rounded to keep headers aligned
+#define ALLOC_ALIGN 16
+
+//size classes: class n holds free blocks of [2^n, 2^(n+1)) bytes
+#define KHEAP_CLASSES 64
+//allocations at least this large are served by palloc
+#define KHEAP_LARGE_ALLOC (2 * PAGE_SIZE_B)
+//smallest page order the heap grows by (64KB)
+#define KHEAP_GROW_ORDER 4
 
 uint64_t TOTAL_HEAP_ALLOC = 0;
 uint64_t TOTAL_KHEAP_CAP = 0;
 
+//counters updated on each call (free space is measured on request)
+kheap_stats_t KHEAP_STATS;
+
+//regions, free lists and counters
+kspinlock_t KHEAP_LOCK = KSPINLOCK_INIT;
+
 /*
- * Linked list of heap allocations
+ * Heap block header (boundary tag)
+ * Blocks are laid out back to back, the next block is found from
+ * the size and the previous one from prev_size while it is free
  */
 typedef struct kheap_alloc_t {
-  //heap flags
-  uint8_t flags;
-  //the size of the allocation
+  //the size of the previous block (only valid if it is free)
+  uint64_t prev_size;
+  //the size of the allocation, flags in the low bits
   uint64_t size;
-  //next and prev ptrs
+} kheap_alloc_t;
+
+/*
+ * Size class free list links, stored in the
+ * memory of a free block
+ */
+typedef struct kheap_free_t {
   struct kheap_alloc_t* next;
   struct kheap_alloc_t* prev;
-} kheap_alloc_t;
+} kheap_free_t;
+
+/*
+ * A contiguous region of heap memory, the heap starts with one
+ * region and grows by adding regions of pages
+ */
+typedef struct kheap_region_t {
+  struct kheap_region_t* next;
+  //the size of the region in bytes
+  uint64_t size;
+  //the page order of the region, if it came from palloc
+  uint8_t order;
+  //whether the region can be returned to the page allocator
+  uint8_t releasable;
+} __attribute__((aligned(16))) kheap_region_t;
+
+//heap regions, the first is the initial heap
+kheap_region_t* KHEAP_REGIONS = NULL;
+
+//free blocks by size class
+kheap_alloc_t* KHEAP_FREE_CLASSES[KHEAP_CLASSES];
+//bit n set if size class n has a free block
+uint64_t KHEAP_CLASS_MAP = 0;
+
+//occupancy by size class
+uint64_t KHEAP_CLASS_FREE[KHEAP_CLASSES];
+uint64_t KHEAP_CLASS_USED[KHEAP_CLASSES];
+
+static inline uint64_t block_size(kheap_alloc_t *block) {
+  return block->size & ~(uint64_t) FLAG_MASK;
+}
+
+static inline uint64_t block_flags(kheap_alloc_t *block) {
+  return block->size & FLAG_MASK;
+}
+
+static inline kheap_alloc_t* block_next(kheap_alloc_t *block) {
+  return (kheap_alloc_t*) ((uint64_t) (block + 1) + block_size(block));
+}
 
-//allocations
-kheap_alloc_t* KHEAP_ALLOCS = NULL;
+static inline kheap_alloc_t* block_prev(kheap_alloc_t *block) {
+  return ((kheap_alloc_t*) ((uint64_t) block - block->prev_size)) - 1;
+}
+
+static inline kheap_alloc_t* region_first(kheap_region_t *region) {
+  return (kheap_alloc_t*) (region + 1);
+}
+
+/**
+ * Account for allocated bytes, tracking the high-water mark
+ * @param bytes the size of the allocated block
+ */
+static inline void heap_used_add(uint64_t bytes) {
+  TOTAL_HEAP_ALLOC += bytes;
+  if (TOTAL_HEAP_ALLOC > KHEAP_STATS.peak) {
+    KHEAP_STATS.peak = TOTAL_HEAP_ALLOC;
+  }
+}
 
 void show_alloc_table() {
   debug_log("ALLOC TABLE");
-  kheap_alloc_t *curr = KHEAP_ALLOCS;
-  while (curr != NULL) {
-    debug_val("Flags",curr->flags);
-    debug_val(" size",curr->size);
+  for (kheap_region_t *region=KHEAP_REGIONS; region!=NULL; region=region->next) {
+    debug_val("Region",region->size);
+
+    kheap_alloc_t *curr = region_first(region);
+    //each region ends with an empty allocated block
+    while (block_size(curr) != 0) {
+      debug_val("Flags",block_flags(curr));
+      debug_val(" size",block_size(curr));
+
+      if (curr->size & FLAG_ALLOCATED) {
+        debug_log(" (allocated)");
+      } else {
+        debug_log(" (free)");
+      }
 
-    if (curr->flags & FLAG_ALLOCATED) {
-      debug_log(" (allocated)");
-    } else {
-      debug_log(" (free)");
+      curr = block_next(curr);
     }
+  }
+}
+
+/**
+ * Get the size class of a block size
+ * @param  size the size
+ * @return      floor(log2(size))
+ */
+static inline uint8_t size_class(uint64_t size) {
+  return 63 - __builtin_clzl(size);
+}
+
+static inline kheap_free_t* free_links(kheap_alloc_t *block) {
+  return (kheap_free_t*) (block + 1);
+}
 
-    curr = curr->next;
+/**
+ * Add a free block to the list for its size class
+ * and write its boundary tag
+ * @param block the block
+ */
+static void class_push(kheap_alloc_t *block) {
+  uint8_t cls = size_class(block_size(block));
+  free_links(block)->prev = NULL;
+  free_links(block)->next = KHEAP_FREE_CLASSES[cls];
+  if (KHEAP_FREE_CLASSES[cls] != NULL) {
+    free_links(KHEAP_FREE_CLASSES[cls])->prev = block;
+  }
+  KHEAP_FREE_CLASSES[cls] = block;
+  KHEAP_CLASS_MAP |= 1UL << cls;
+  KHEAP_CLASS_FREE[cls]++;
+
+  //the next block can find this one while it is free
+  kheap_alloc_t *next = block_next(block);
+  next->prev_size = block_size(block);
+  next->size = next->size & ~(uint64_t) FLAG_PREV_ALLOCATED;
+}
+
+/**
+ * Remove a free block from the list for its size class
+ * @param block the block
+ */
+static void class_remove(kheap_alloc_t *block) {
+  uint8_t cls = size_class(block_size(block));
+  kheap_free_t *links = free_links(block);
+  if (links->prev != NULL) {
+    free_links(links->prev)->next = links->next;
+  } else {
+    KHEAP_FREE_CLASSES[cls] = links->next;
+  }
+  if (links->next != NULL) {
+    free_links(links->next)->prev = links->prev;
+  }
+  if (KHEAP_FREE_CLASSES[cls] == NULL) {
+    KHEAP_CLASS_MAP &= ~(1UL << cls);
   }
+  KHEAP_CLASS_FREE[cls]--;
+}
+
+/**
+ * Find a free block of at least size bytes
+ * @param  size the size needed
+ * @return      the block, NULL if none
+ */
+static kheap_alloc_t* class_find(uint64_t size) {
+  //any block in a class above floor(log2(size)) fits
+  uint8_t cls = size_class(size);
+  uint64_t fits = KHEAP_CLASS_MAP & ~((2UL << cls) - 1);
+  if (fits) {
+    return KHEAP_FREE_CLASSES[__builtin_ctzl(fits)];
+  }
+
+  //otherwise first fit within the class itself
+  kheap_alloc_t *curr = KHEAP_FREE_CLASSES[cls];
+  while ((curr != NULL) && (block_size(curr) < size)) {
+    curr = free_links(curr)->next;
+  }
+  return curr;
+}
+
+/**
+ * Add a region of memory to the heap as one free block
+ * followed by an empty allocated block, so that merging
+ * stops at both ends of the region
+ * @param region the start of the region
+ * @param size   the size of the region
+ */
+static void kheap_add_region(kheap_region_t *region, uint64_t size) {
+  region->size = size;
+  region->next = KHEAP_REGIONS;
+  KHEAP_REGIONS = region;
+
+  kheap_alloc_t *first = region_first(region);
+  first->prev_size = 0;
+  first->size = (size - sizeof(kheap_region_t) - (2 * sizeof(kheap_alloc_t))) |
+                FLAG_PREV_ALLOCATED;
+
+  kheap_alloc_t *end = block_next(first);
+  end->prev_size = 0;
+  end->size = FLAG_ALLOCATED;
+
+  class_push(first);
+
+  TOTAL_KHEAP_CAP += size;
 }
 
 /**
  * Initialize the kernel heap
  * @param heap_start the starting offset of the heap
- * @param heap_size  the size of the heap
+ * @param heap_size  the initial size of the heap
  */
 void init_kheap(uint64_t heap_start,
                 uint64_t heap_size) {
-  //zero
-  memset((void*) heap_start,0,sizeof(kheap_alloc_t));
-  KHEAP_ALLOCS = (kheap_alloc_t*) heap_start;
-  //starting heap initialization
-  KHEAP_ALLOCS->flags = 0;
-  KHEAP_ALLOCS->size = heap_size;
-  KHEAP_ALLOCS->next = NULL;
-  KHEAP_ALLOCS->prev = NULL;
+  for (int c=0; c<KHEAP_CLASSES; c++) {
+    KHEAP_FREE_CLASSES[c] = NULL;
+    KHEAP_CLASS_FREE[c] = 0;
+    KHEAP_CLASS_USED[c] = 0;
+  }
+  KHEAP_CLASS_MAP = 0;
+  KHEAP_REGIONS = NULL;
+  TOTAL_KHEAP_CAP = 0;
+  TOTAL_HEAP_ALLOC = 0;
+  memset(&KHEAP_STATS,0,sizeof(kheap_stats_t));
+
+  //the initial region is part of the kernel image reservation
+  kheap_region_t *region = (kheap_region_t*) heap_start;
+  region->order = 0;
+  region->releasable = 0;
+  kheap_add_region(region,heap_size);
+}
+
+/**
+ * Grow the heap by a region of pages
+ * @param  size the allocation the region must fit
+ * @return      0 on success, pos on error
+ */
+static uint8_t kheap_grow(uint64_t size) {
+  uint64_t needed = size + sizeof(kheap_region_t) + (2 * sizeof(kheap_alloc_t));
+  uint8_t order = KHEAP_GROW_ORDER;
+  while (((uint64_t) PAGE_SIZE_B << order) < needed) {
+    order++;
+  }
 
-  TOTAL_KHEAP_CAP = heap_size;
+  //boundary tags are written by kheap_add_region, nothing relies on zeroes
+  kheap_region_t *region = (kheap_region_t*) palloc_order_nozero(order);
+  if (region == NULL) {
+    return 1;
+  }
+  region->order = order;
+  region->releasable = 1;
+  kheap_add_region(region,(uint64_t) PAGE_SIZE_B << order);
+  return 0;
 }
 
 /**
- * Allocate some block of heap memory
+ * Return regions the heap grew by that are entirely free
+ * to the page allocator
+ * @return the number of pages released
+ */
+uint64_t kheap_trim() {
+  uint64_t released = 0;
+  kheap_region_t **link = &KHEAP_REGIONS;
+
+  //called by the page allocator when it runs short, which may be
+  //from inside kmalloc when the heap grows: skip if the heap is busy
+  uint64_t flags = irq_save();
+  if (!kspin_trylock(&KHEAP_LOCK)) {
+    irq_restore(flags);
+    return 0;
+  }
+
+  while (*link != NULL) {
+    kheap_region_t *region = *link;
+    kheap_alloc_t *first = region_first(region);
+
+    //free and followed by the end of the region
+    if (region->releasable &&
+        !(first->size & FLAG_ALLOCATED) &&
+        (block_size(block_next(first)) == 0)) {
+      class_remove(first);
+      *link = region->next;
+      TOTAL_KHEAP_CAP -= region->size;
+      released += 1UL << region->order;
+      pfree_order(region,region->order);
+    } else {
+      link = &region->next;
+    }
+  }
+  kspin_unlock_irqrestore(&KHEAP_LOCK,flags);
+  return released;
+}
+
+/**
+ * Get the page order needed for a large allocation
+ * @param  size the size of the allocation
+ * @return      the order
+ */
+static uint8_t large_order(uint64_t size) {
+  uint8_t order = 0;
+  while (((uint64_t) PAGE_SIZE_B << order) < (size + sizeof(kheap_alloc_t))) {
+    order++;
+  }
+  return order;
+}
+
+/**
+ * Allocate a block directly from the page allocator
  * @param size the size of the allocation
  */
-void* kmalloc(uint64_t size) {
+static void* kmalloc_large(uint64_t size) {
+  uint8_t order = large_order(size);
 
-  if (size <= 0) {
+  kheap_alloc_t *header = (kheap_alloc_t*) palloc_order(order);
+  if (header == NULL) {
+    debug_log("kheap out of pages");
+    set_errno(ERRNO_KMALLOC);
     return NULL;
   }
+  header->prev_size = 0;
+  header->size = ((PAGE_SIZE_B << order) - sizeof(kheap_alloc_t)) |
+                 FLAG_ALLOCATED | FLAG_LARGE;
+  heap_used_add(block_size(header));
+  return header + 1;
+}
 
-  TOTAL_HEAP_ALLOC += size;
+/**
+ * Trim a block being allocated to size bytes, returning
+ * the remainder to the free lists if it is large enough
+ * @param block the block (not on a free list)
+ * @param size  the rounded size needed
+ */
+static void block_split(kheap_alloc_t *block, uint64_t size) {
+  uint64_t avail = block_size(block);
+  if (avail >= (size + sizeof(kheap_alloc_t) + MIN_ALLOC_SIZE)) {
+    block->size = size | block_flags(block);
+
+    //the header representing the remaining space after allocation
+    kheap_alloc_t* new_header = block_next(block);
+    new_header->size = (avail - (sizeof(kheap_alloc_t) + size)) |
+                       FLAG_PREV_ALLOCATED;
+
+    //merge the remainder with a free block after it
+    kheap_alloc_t *next = block_next(new_header);
+    if (!(next->size & FLAG_ALLOCATED)) {
+      class_remove(next);
+      new_header->size += block_size(next) + sizeof(kheap_alloc_t);
+    }
+    class_push(new_header);
+  } else {
+    //the whole block is used
+    block_next(block)->size |= FLAG_PREV_ALLOCATED;
+  }
+}
+
+/**
+ * Move the start of a block (not on a free list) forward so that
+ * its memory is aligned, returning the leading gap to the free lists
+ * @param  block the block
+ * @param  align the alignment (power of two, more than ALLOC_ALIGN)
+ * @return       the aligned block
+ */
+static kheap_alloc_t* block_align(kheap_alloc_t *block, uint64_t align) {
+  uint64_t memory = (uint64_t) (block + 1);
+  uint64_t aligned = (memory + align - 1) & ~(align - 1);
+  if (aligned == memory) {
+    return block;
+  }
+
+  //the gap must hold a free block of its own
+  if ((aligned - memory) < (sizeof(kheap_alloc_t) + MIN_ALLOC_SIZE)) {
+    aligned += align;
+  }
+  uint64_t gap = aligned - memory;
+
+  kheap_alloc_t *moved = ((kheap_alloc_t*) aligned) - 1;
+  moved->size = block_size(block) - gap;
+
+  //the previous block is allocated (free blocks are always merged)
+  block->size = (gap - sizeof(kheap_alloc_t)) | block_flags(block);
+  class_push(block);
+  return moved;
+}
+
+/**
+ * Allocate some block of heap memory (not counted)
+ * @param size  the size of the allocation
+ * @param align the alignment of the allocation (power of two)
+ */
+static void* kmalloc_block(uint64_t size, uint64_t align) {
+
+  if ((size >= KHEAP_LARGE_ALLOC) && (align <= ALLOC_ALIGN)) {
+    return kmalloc_large(size);
+  }
 
   //set the minimum allocation size
   if (size < MIN_ALLOC_SIZE) {
     size = MIN_ALLOC_SIZE;
   }
+  size = (size + ALLOC_ALIGN - 1) & ~(uint64_t)(ALLOC_ALIGN - 1);
 
-  kheap_alloc_t *curr = KHEAP_ALLOCS;
-  while ((curr != NULL) &&
-         ((curr->flags & FLAG_ALLOCATED) ||
-          (curr->size < (size + sizeof(kheap_alloc_t))))) {
-    curr = curr->next;
+  //room to move the block forward to an aligned address
+  uint64_t needed = size;
+  if (align > ALLOC_ALIGN) {
+    needed += align + sizeof(kheap_alloc_t);
+  }
+
+  kheap_alloc_t *curr = class_find(needed);
+
+  //grow the heap with more pages
+  if ((curr == NULL) && (kheap_grow(needed) == 0)) {
+    curr = class_find(needed);
   }
 
   if (curr == NULL) {
-    //show_alloc_table();
-    debug_log("kheap out of space");
-    debug_kheap();
+    //logged by the caller once KHEAP_LOCK is dropped
     set_errno(ERRNO_KMALLOC);
     return NULL;
   }
+  class_remove(curr);
+  if (align > ALLOC_ALIGN) {
+    curr = block_align(curr,align);
+  }
+  block_split(curr,size);
 
-  //determine remaining size with metadata storage
-  uint64_t avail = curr->size - sizeof(kheap_alloc_t);
+  //mark as allocated
+  curr->size = curr->size | FLAG_ALLOCATED;
+  KHEAP_CLASS_USED[size_class(block_size(curr))]++;
+  heap_used_add(block_size(curr));
 
-  //check if this allocation should be split
-  if ((avail - MIN_ALLOC_SIZE) > size) {
-    uint64_t rem_alloc_addr = (uint64_t) curr + sizeof(kheap_alloc_t) + size;
-    memset((void*)rem_alloc_addr,0,sizeof(kheap_alloc_t));
+  //memory location (after metadata)
+  return curr + 1;
+}
 
-    //the header representing the remaining space after allocation
-    kheap_alloc_t* new_header = (kheap_alloc_t*) rem_alloc_addr;
-    new_header->flags = 0;
-    new_header->size = curr->size - (sizeof(kheap_alloc_t) + size);
+/**
+ * Allocate some block of heap memory
+ * @param size the size of the allocation
+ */
+void* kmalloc(uint64_t size) {
+  return kmalloc_aligned(size,ALLOC_ALIGN);
+}
+
+/**
+ * Allocate some block of heap memory at an aligned address
+ * (krealloc() does not keep the alignment)
+ * @param size  the size of the allocation
+ * @param align the alignment, a power of two up to the page size
+ *              (e.g. 64 for a cache line)
+ * @return      the allocation, NULL on error
+ */
+void* kmalloc_aligned(uint64_t size, uint64_t align) {
 
-    //update linked list
-    new_header->prev = curr;
-    new_header->next = curr->next;
-    curr->next = new_header;
+  if (size <= 0) {
+    return NULL;
+  }
 
-    if (curr->next != NULL) {
-      curr->next->prev = new_header;
+  if ((align & (align - 1)) || (align > PAGE_SIZE_B)) {
+    debug_err("kmalloc_aligned with unsupported alignment");
+    return NULL;
+  }
+  if (align < ALLOC_ALIGN) {
+    align = ALLOC_ALIGN;
+  }
+
+  uint64_t flags = kspin_lock_irqsave(&KHEAP_LOCK);
+  uint64_t start = get_cycle_count();
+  void *memory = kmalloc_block(size,align);
+  uint64_t cycles = get_cycle_count() - start;
+
+  if (memory != NULL) {
+    KHEAP_STATS.allocs++;
+    KHEAP_STATS.hist[size_class(size)]++;
+    KHEAP_STATS.alloc_cycles += cycles;
+    if (cycles > KHEAP_STATS.alloc_cycles_max) {
+      KHEAP_STATS.alloc_cycles_max = cycles;
     }
+  }
+  kspin_unlock_irqrestore(&KHEAP_LOCK,flags);
 
-    //reduce size of current
-    curr->size = size;
+  //debug_kheap() takes the (non-recursive) heap lock itself
+  if (memory == NULL) {
+    debug_log("kheap out of space");
+    debug_kheap();
   }
+  return memory;
+}
 
-  //mark as allocated
-  curr->flags = curr->flags | FLAG_ALLOCATED;
+/**
+ * Free a heap allocation (not counted)
+ * @param addr the address to free
+ */
+static void kfree_block(void *addr) {
+  //locate the segment header
+  kheap_alloc_t* header = ((kheap_alloc_t*) addr) - 1;
 
-  //memory location (after metadata)
-  return curr + 1;
+  if (!(header->size & FLAG_ALLOCATED)) {
+    debug_err("kfree on memory that is not allocated");
+    return;
+  }
+
+  //reclaimed space
+  TOTAL_HEAP_ALLOC -= block_size(header);
+
+  if (header->size & FLAG_LARGE) {
+    uint8_t order = large_order(block_size(header));
+    header->size = 0;
+    pfree_order(header,order);
+    return;
+  }
+
+  //mark allocation as free
+  KHEAP_CLASS_USED[size_class(block_size(header))]--;
+  header->size = header->size & ~(uint64_t) FLAG_ALLOCATED;
+
+  //attempt to merge left
+  if (!(header->size & FLAG_PREV_ALLOCATED)) {
+    kheap_alloc_t *prev = block_prev(header);
+    class_remove(prev);
+    //expand by freeing space and addr allocation header
+    prev->size += block_size(header) + sizeof(kheap_alloc_t);
+    //complete merge
+    header = prev;
+  }
+
+  //attempt to merge right
+  kheap_alloc_t *next = block_next(header);
+  if (!(next->size & FLAG_ALLOCATED)) {
+    class_remove(next);
+    header->size += block_size(next) + sizeof(kheap_alloc_t);
+  }
+
+  class_push(header);
 }
 
 /**
@@ -141,48 +576,151 @@ void kfree(void *addr) {
     return;
   }
 
-  //locate the segment header
-  kheap_alloc_t* header = (kheap_alloc_t*)(uint64_t)addr - sizeof(kheap_alloc_t);
-
-  if ((header != NULL) && (header->flags & FLAG_ALLOCATED)) {
-    //mark allocation as free
-    header->flags = header->flags & ~FLAG_ALLOCATED;
-
-    //reclaimed space
-    TOTAL_HEAP_ALLOC -= header->size;
-
-    //attempt to merge left
-    if ((header->prev != NULL) && !(header->prev->flags & FLAG_ALLOCATED)) {
-      //expand by freeing space and addr allocation header
-      header->prev->size += header->size + sizeof(kheap_alloc_t);
-      //update linked list
-      header->prev->next = header->next;
-      if (header->next != NULL) {
-        header->next->prev = header->prev;
-      }
+  uint64_t flags = kspin_lock_irqsave(&KHEAP_LOCK);
+  uint64_t start = get_cycle_count();
+  kfree_block(addr);
+  uint64_t cycles = get_cycle_count() - start;
+
+  KHEAP_STATS.frees++;
+  KHEAP_STATS.free_cycles += cycles;
+  if (cycles > KHEAP_STATS.free_cycles_max) {
+    KHEAP_STATS.free_cycles_max = cycles;
+  }
+  kspin_unlock_irqrestore(&KHEAP_LOCK,flags);
+}
 
-      //complete merge
-      header = header->prev;
+/**
+ * Resize a heap allocation
+ * Grows in place into a following free block when possible,
+ * otherwise moves the allocation
+ * @param addr the allocation (NULL to allocate)
+ * @param size the new size
+ * @return the resized allocation, NULL on error (addr is left intact)
+ */
+void* krealloc(void *addr, uint64_t size) {
+  if (addr == NULL) {
+    return kmalloc(size);
+  }
+  if (size == 0) {
+    kfree(addr);
+    return NULL;
+  }
+
+  uint64_t flags = kspin_lock_irqsave(&KHEAP_LOCK);
+  kheap_alloc_t* header = ((kheap_alloc_t*) addr) - 1;
+  uint64_t old_size = block_size(header);
+
+  if (!(header->size & FLAG_LARGE) && (size < KHEAP_LARGE_ALLOC)) {
+    if (size < MIN_ALLOC_SIZE) {
+      size = MIN_ALLOC_SIZE;
     }
+    size = (size + ALLOC_ALIGN - 1) & ~(uint64_t)(ALLOC_ALIGN - 1);
 
-    //attempt to merge right
-    if ((header->next != NULL) && !(header->next->flags & FLAG_ALLOCATED)) {
-      header->size += header->next->size + sizeof(kheap_alloc_t);
+    kheap_alloc_t *next = block_next(header);
+    uint64_t avail = old_size;
+    if (!(next->size & FLAG_ALLOCATED)) {
+      avail += sizeof(kheap_alloc_t) + block_size(next);
+    }
 
-      //update linked list
-      if (header->next->next != NULL) {
-        header->next->next->prev = header;
+    if (avail >= size) {
+      //absorb the following free block
+      if (avail != old_size) {
+        class_remove(next);
+        header->size += sizeof(kheap_alloc_t) + block_size(next);
       }
+      block_split(header,size);
+
+      KHEAP_CLASS_USED[size_class(old_size)]--;
+      KHEAP_CLASS_USED[size_class(block_size(header))]++;
+      TOTAL_HEAP_ALLOC -= old_size;
+      heap_used_add(block_size(header));
+      kspin_unlock_irqrestore(&KHEAP_LOCK,flags);
+      return addr;
+    }
+  } else if ((header->size & FLAG_LARGE) && (size <= old_size)) {
+    kspin_unlock_irqrestore(&KHEAP_LOCK,flags);
+    return addr;
+  }
+  kspin_unlock_irqrestore(&KHEAP_LOCK,flags);
 
-      header->next = header->next->next;
+  //move the allocation
+  void *moved = kmalloc(size);
+  if (moved == NULL) {
+    return NULL;
+  }
+  memcpy(moved,addr,old_size < size ? old_size : size);
+  kfree(addr);
+  return moved;
+}
+
+/**
+ * Get the heap counters
+ * @param stats the counters (set)
+ */
+void kheap_get_stats(kheap_stats_t *stats) {
+  uint64_t flags = kspin_lock_irqsave(&KHEAP_LOCK);
+  memcpy(stats,&KHEAP_STATS,sizeof(kheap_stats_t));
+  stats->live = TOTAL_HEAP_ALLOC;
+  stats->cap = TOTAL_KHEAP_CAP;
+
+  //walk the free lists
+  for (int c=0; c<KHEAP_CLASSES; c++) {
+    for (kheap_alloc_t *curr=KHEAP_FREE_CLASSES[c]; curr!=NULL;
+         curr=free_links(curr)->next) {
+      uint64_t size = block_size(curr);
+      stats->free += size;
+      stats->free_blocks++;
+      if (size > stats->largest_free) {
+        stats->largest_free = size;
+      }
     }
   }
+
+  if (stats->free > 0) {
+    stats->frag_pct = 100 - ((stats->largest_free * 100) / stats->free);
+  }
+  kspin_unlock_irqrestore(&KHEAP_LOCK,flags);
 }
 
 /**
  * Show debug info
  */
 void debug_kheap() {
-  debug_val("kheap_used",TOTAL_HEAP_ALLOC);
-  debug_val("kheap_cap",TOTAL_KHEAP_CAP);
+  kheap_stats_t stats;
+  kheap_get_stats(&stats);
+
+  debug_val("kheap_used",stats.live);
+  debug_val("kheap_peak",stats.peak);
+  debug_val("kheap_cap",stats.cap);
+  debug_val("kheap_free",stats.free);
+  debug_val("kheap_free_blocks",stats.free_blocks);
+  debug_val("kheap_largest_free",stats.largest_free);
+  debug_val("kheap_frag_pct",stats.frag_pct);
+  debug_val("kheap_allocs",stats.allocs);
+  debug_val("kheap_frees",stats.frees);
+  if (stats.allocs > 0) {
+    debug_val("kheap_alloc_cycles_avg",stats.alloc_cycles / stats.allocs);
+  }
+  debug_val("kheap_alloc_cycles_max",stats.alloc_cycles_max);
+  if (stats.frees > 0) {
+    debug_val("kheap_free_cycles_avg",stats.free_cycles / stats.frees);
+  }
+  debug_val("kheap_free_cycles_max",stats.free_cycles_max);
+
+  //requested sizes
+  for (int b=0; b<KHEAP_HIST_BUCKETS; b++) {
+    if (stats.hist[b]) {
+      debug_val("kheap_hist",1UL << b);
+      debug_val(" allocs",stats.hist[b]);
+    }
+  }
+
+  //occupancy of each size class in use
+  for (int c=0; c<KHEAP_CLASSES; c++) {
+    if (KHEAP_CLASS_FREE[c] || KHEAP_CLASS_USED[c]) {
+      debug_val("kheap_class",1UL << c);
+      debug_val(" free",KHEAP_CLASS_FREE[c]);
+      debug_val(" used",KHEAP_CLASS_USED[c]);
+    }
+  }
 }
@@ -8,10 +8,43 @@
 #include <stdint.h>
 #include <stddef.h>
 
+//allocation size histogram buckets (bucket n counts sizes in [2^n, 2^(n+1)))
+#define KHEAP_HIST_BUCKETS 64
+
+/*
+ * Kernel heap counters
+ */
+typedef struct kheap_stats_t {
+  //bytes in allocated blocks (rounded block sizes)
+  uint64_t live;
+  //high-water mark of live
+  uint64_t peak;
+  //bytes of memory owned by the heap
+  uint64_t cap;
+  //bytes in free blocks
+  uint64_t free;
+  //the number of free blocks
+  uint64_t free_blocks;
+  //the size of the largest free block
+  uint64_t largest_free;
+  //external fragmentation, percent of free memory outside the largest block
+  uint64_t frag_pct;
+  //calls that returned memory
+  uint64_t allocs;
+  uint64_t frees;
+  //cpu cycles spent in kmalloc()/kfree()
+  uint64_t alloc_cycles;
+  uint64_t free_cycles;
+  uint64_t alloc_cycles_max;
+  uint64_t free_cycles_max;
+  //requested sizes by floor(log2(size))
+  uint64_t hist[KHEAP_HIST_BUCKETS];
+} kheap_stats_t;
+
 /**
  * Initialize the kernel heap
  * @param heap_start the starting offset of the heap
- * @param heap_size  the size of the heap
+ * @param heap_size  the initial size of the heap
  */
 void init_kheap(uint64_t heap_start,
                 uint64_t heap_size);
@@ -22,12 +55,45 @@ void init_kheap(uint64_t heap_start,
  */
 void* kmalloc(uint64_t size);
 
+/**
+ * Allocate some block of heap memory at an aligned address
+ * (krealloc() does not keep the alignment)
+ * @param size  the size of the allocation
+ * @param align the alignment, a power of two up to the page size
+ *              (e.g. 64 for a cache line)
+ * @return      the allocation, NULL on error
+ */
+void* kmalloc_aligned(uint64_t size, uint64_t align);
+
 /**
  * Free a heap allocation
  * @param addr the address to free
  */
 void kfree(void *addr);
 
+/**
+ * Resize a heap allocation
+ * Grows in place into a following free block when possible,
+ * otherwise moves the allocation
+ * @param addr the allocation (NULL to allocate)
+ * @param size the new size
+ * @return the resized allocation, NULL on error (addr is left intact)
+ */
+void* krealloc(void *addr, uint64_t size);
+
+/**
+ * Return regions the heap grew by that are entirely free
+ * to the page allocator
+ * @return the number of pages released
+ */
+uint64_t kheap_trim();
+
+/**
+ * Get the heap counters
+ * @param stats the counters (set)
+ */
+void kheap_get_stats(kheap_stats_t *stats);
+
 /**
  * Show debug info
  */
@@ -0,0 +1,236 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "kslab.h"
+#include "kheap.h"
+#include "mmu.h"
+#include "../uart/debug.h"
+#include "../smp/spinlock.h"
+
+//objects are aligned to 16 bytes
+#define SLAB_ALIGN 16
+
+/*
+ * A free object, linked through its own memory
+ */
+typedef struct kslab_obj_t {
+  struct kslab_obj_t* next;
+} kslab_obj_t;
+
+/*
+ * A slab, one page of objects with this header at the start
+ */
+typedef struct kslab_t {
+  //the owning cache
+  struct kmem_cache_t* cache;
+  //free objects in this slab
+  kslab_obj_t* free;
+  //objects allocated from this slab
+  uint64_t inuse;
+  //partial slab list ptrs
+  struct kslab_t* next;
+  struct kslab_t* prev;
+} kslab_t;
+
+//the slab header rounded up so the first object is aligned
+#define SLAB_HDR_SIZE ((sizeof(kslab_t) + SLAB_ALIGN - 1) & ~(uint64_t)(SLAB_ALIGN - 1))
+
+struct kmem_cache_t {
+  //the name of the cache
+  const char *name;
+  //the size of each object
+  uint64_t size;
+  //objects per slab
+  uint64_t per_slab;
+  //slabs with at least one free object
+  kslab_t* partial;
+  //total slabs and objects in use
+  uint64_t slabs;
+  uint64_t inuse;
+  //slabs and counters
+  kspinlock_t lock;
+};
+
+/**
+ * Create a cache for objects of a fixed size
+ * @param  name the name of the cache
+ * @param  size the size of each object (at most a quarter page)
+ * @return      the cache, NULL on error
+ */
+kmem_cache_t* kmem_cache_create(const char *name, uint64_t size) {
+  if ((size == 0) || (size > (PAGE_SIZE_B / 4))) {
+    return NULL;
+  }
+
+  kmem_cache_t *cache = (kmem_cache_t*) kmalloc(sizeof(kmem_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  //objects are large enough to hold the free list link
+  if (size < sizeof(kslab_obj_t)) {
+    size = sizeof(kslab_obj_t);
+  }
+  cache->name = name;
+  cache->size = (size + SLAB_ALIGN - 1) & ~(uint64_t)(SLAB_ALIGN - 1);
+  cache->per_slab = (PAGE_SIZE_B - SLAB_HDR_SIZE) / cache->size;
+  cache->partial = NULL;
+  cache->slabs = 0;
+  cache->inuse = 0;
+  cache->lock.locked = 0;
+  return cache;
+}
+
+/**
+ * Get the first object in a slab (after the aligned header)
+ * @param  slab the slab
+ * @return      the address of the first object
+ */
+static uint64_t slab_objs_start(kslab_t *slab) {
+  //slabs are page aligned
+  return (uint64_t) slab + SLAB_HDR_SIZE;
+}
+
+/**
+ * Add a slab to the partial list
+ */
+static void slab_push_partial(kmem_cache_t *cache, kslab_t *slab) {
+  slab->prev = NULL;
+  slab->next = cache->partial;
+  if (slab->next != NULL) {
+    slab->next->prev = slab;
+  }
+  cache->partial = slab;
+}
+
+/**
+ * Remove a slab from the partial list
+ */
+static void slab_remove_partial(kmem_cache_t *cache, kslab_t *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    cache->partial = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+/**
+ * Carve a new page into a slab of free objects
+ * @param  cache the cache to grow
+ * @return       the new slab, NULL on error
+ */
+static kslab_t* slab_grow(kmem_cache_t *cache) {
+  kslab_t *slab = (kslab_t*) palloc_nozero();
+  if (slab == NULL) {
+    return NULL;
+  }
+
+  slab->cache = cache;
+  slab->free = NULL;
+  slab->inuse = 0;
+
+  //build the free list in address order
+  uint64_t obj = slab_objs_start(slab);
+  kslab_obj_t **tail = &slab->free;
+  for (uint64_t i=0; i<cache->per_slab; i++) {
+    *tail = (kslab_obj_t*) obj;
+    tail = &((kslab_obj_t*) obj)->next;
+    obj += cache->size;
+  }
+  *tail = NULL;
+
+  slab_push_partial(cache,slab);
+  cache->slabs++;
+  return slab;
+}
+
+/**
+ * Allocate an object from a cache (not cleared)
+ * @param  cache the cache
+ * @return       the object, NULL on error
+ */
+void* kmem_cache_alloc(kmem_cache_t *cache) {
+  uint64_t flags = kspin_lock_irqsave(&cache->lock);
+  kslab_t *slab = cache->partial;
+  if (slab == NULL) {
+    slab = slab_grow(cache);
+    if (slab == NULL) {
+      kspin_unlock_irqrestore(&cache->lock,flags);
+      debug_log("kmem_cache out of pages");
+      return NULL;
+    }
+  }
+
+  kslab_obj_t *obj = slab->free;
+  slab->free = obj->next;
+  slab->inuse++;
+  cache->inuse++;
+
+  //full slabs leave the partial list
+  if (slab->free == NULL) {
+    slab_remove_partial(cache,slab);
+  }
+  kspin_unlock_irqrestore(&cache->lock,flags);
+  return obj;
+}
+
+/**
+ * Return an object to its cache
+ * @param cache the cache the object was allocated from
+ * @param obj   the object
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+  if (obj == NULL) {
+    return;
+  }
+
+  //the slab header is at the start of the page
+  kslab_t *slab = (kslab_t*) ((uint64_t) obj & ~(uint64_t)(PAGE_SIZE_B - 1));
+  if (slab->cache != cache) {
+    debug_err("kmem_cache_free on object from another cache");
+    return;
+  }
+
+  uint64_t flags = kspin_lock_irqsave(&cache->lock);
+
+  //nothing in the slab is allocated, so obj was already freed
+  if (slab->inuse == 0) {
+    kspin_unlock_irqrestore(&cache->lock,flags);
+    debug_err("kmem_cache_free on object that is not allocated");
+    return;
+  }
+
+  //a full slab becomes partial again
+  if (slab->free == NULL) {
+    slab_push_partial(cache,slab);
+  }
+
+  ((kslab_obj_t*) obj)->next = slab->free;
+  slab->free = (kslab_obj_t*) obj;
+  slab->inuse--;
+  cache->inuse--;
+
+  //release an empty slab unless it is the only one left
+  if ((slab->inuse == 0) &&
+      ((slab->next != NULL) || (slab->prev != NULL))) {
+    slab_remove_partial(cache,slab);
+    cache->slabs--;
+    pfree(slab);
+  }
+  kspin_unlock_irqrestore(&cache->lock,flags);
+}
+
+/**
+ * Show debug info for a cache
+ * @param cache the cache
+ */
+void debug_kmem_cache(kmem_cache_t *cache) {
+  debug_log(cache->name);
+  debug_val(" obj_size",cache->size);
+  debug_val(" slabs",cache->slabs);
+  debug_val(" inuse",cache->inuse);
+}
@@ -0,0 +1,44 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _MMU_KSLAB_H
+#define _MMU_KSLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A cache of same size objects carved from pages
+ */
+typedef struct kmem_cache_t kmem_cache_t;
+
+/**
+ * Create a cache for objects of a fixed size
+ * @param  name the name of the cache
+ * @param  size the size of each object (at most a quarter page)
+ * @return      the cache, NULL on error
+ */
+kmem_cache_t* kmem_cache_create(const char *name, uint64_t size);
+
+/**
+ * Allocate an object from a cache (not cleared)
+ * @param  cache the cache
+ * @return       the object, NULL on error
+ */
+void* kmem_cache_alloc(kmem_cache_t *cache);
+
+/**
+ * Return an object to its cache
+ * @param cache the cache the object was allocated from
+ * @param obj   the object
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/**
+ * Show debug info for a cache
+ * @param cache the cache
+ */
+void debug_kmem_cache(kmem_cache_t *cache);
+
+#endif /*_MMU_KSLAB_H*/
@@ -3,33 +3,129 @@
  */
 
 #include "mmu.h"
+#include "kheap.h"
 #include "../uart/debug.h"
+#include "../smp/spinlock.h"
 
 //end of the kernel image
 extern uint8_t __end;
 
-#define FLAG_ALLOCATED 0x80
-#define FLAG_KERNEL 0x40
-#define FLAG_KHEAP 0x20
+//bits per bitmap word
+#define MAP_WORD_BITS 64
 
-/**
- * Defines the allocation of a physical page
+//pages kept zeroed (or waiting to be zeroed) ahead of palloc()
+#define P_ZERO_POOL_TARGET 64
+
+//peripheral windows (identity mapped as device memory)
+#define PERIPH_BASE       0x3F000000
+#define PERIPH_SIZE       0x01000000
+#define LOCAL_PERIPH_BASE 0x40000000
+#define LOCAL_PERIPH_SIZE 0x00040000
+
+//MAIR_EL1 attribute indices
+#define MAIR_IDX_DEVICE_nGnRnE 0
+#define MAIR_IDX_DEVICE_nGnRE  1
+#define MAIR_IDX_NORMAL        2
+#define MAIR_IDX_NORMAL_NC     3
+#define MAIR_VALUE ((0x00UL << (8 * MAIR_IDX_DEVICE_nGnRnE)) | \
+                    (0x04UL << (8 * MAIR_IDX_DEVICE_nGnRE)) | \
+                    (0xFFUL << (8 * MAIR_IDX_NORMAL)) | \
+                    (0x44UL << (8 * MAIR_IDX_NORMAL_NC)))
+
+//TCR_EL1: 39 bit VA, 4KB granule, cacheable inner shareable walks,
+//TTBR1 walks disabled
+#define TCR_T0SZ   (64 - 39)
+#define TCR_IRGN0  (1UL << 8)
+#define TCR_ORGN0  (1UL << 10)
+#define TCR_SH0    (3UL << 12)
+#define TCR_EPD1   (1UL << 23)
+#define TCR_TG1    (2UL << 30)
+#define TCR_VALUE  (TCR_T0SZ | TCR_IRGN0 | TCR_ORGN0 | TCR_SH0 | \
+                    TCR_EPD1 | TCR_TG1)
+
+//SCTLR_EL1 bits
+#define SCTLR_M (1UL << 0)
+#define SCTLR_C (1UL << 2)
+#define SCTLR_I (1UL << 12)
+
+//translation table descriptor bits
+#define PT_ENTRIES     512
+#define PT_VALID       0x1
+#define PT_TYPE_MASK   0x3
+#define PT_BLOCK       0x1
+#define PT_TABLE       0x3
+#define PT_PAGE        0x3
+#define PT_ATTR(idx)   ((uint64_t)(idx) << 2)
+#define PT_SH_INNER    (3UL << 8)
+#define PT_AF          (1UL << 10)
+#define PT_PXN         (1UL << 53)
+#define PT_UXN         (1UL << 54)
+#define PT_ADDR_MASK   0x0000FFFFFFFFF000UL
+
+//level 2 block descriptors map 2MB
+#define PT_BLOCK_SIZE       (1UL << 21)
+#define PT_BLOCK_ADDR_MASK  0x0000FFFFFFE00000UL
+
+//translation table indices by level
+#define PT_L1_IDX(va) (((va) >> 30) & (PT_ENTRIES - 1))
+#define PT_L2_IDX(va) (((va) >> 21) & (PT_ENTRIES - 1))
+#define PT_L3_IDX(va) (((va) >> 12) & (PT_ENTRIES - 1))
+
+/*
+ * A free buddy block, stored in the
+ * first page of the block itself
+ */
+typedef struct pfree_block_t {
+  struct pfree_block_t* next;
+  struct pfree_block_t* prev;
+  //the order of this block
+  uint64_t order;
+} pfree_block_t;
+
+/*
+ * Page frame database, one bit per physical page
  */
-typedef struct phy_page_t {
-  //flags for this page
-  //flags[7] - whether the page is allocated
-  //flags[6] - whether the page is used by the kernel
-  //flags[5] - whether the page is used by kheap
-  uint8_t flags;
-  //the address of the page
-  uint64_t addr;
-} phy_page_t;
+//pages heading an allocated block
+uint64_t* P_ALLOC_MAP = NULL;
+//pages heading a free buddy block
+uint64_t* P_BUDDY_MAP = NULL;
+//pages used by the kernel (image, frame database, heap)
+uint64_t* P_KERNEL_MAP = NULL;
+//pages used by kheap
+uint64_t* P_KHEAP_MAP = NULL;
+//the order of each allocated block, one byte per page (set at the head)
+uint8_t* P_ORDER_MAP = NULL;
+
+//the number of physical pages
+uint64_t P_PAGES_COUNT = 0;
+
+//free blocks by order
+pfree_block_t* P_FREE_AREAS[P_MAX_ORDER + 1];
+//pages held by the buddy allocator
+uint64_t P_PAGES_FREE = 0;
+
+//pages handed out by palloc
+uint64_t P_PAGES_USED = 0;
+uint64_t P_PAGES_PEAK = 0;
+//calls to palloc/pfree
+uint64_t P_ALLOC_CALLS = 0;
+uint64_t P_FREE_CALLS = 0;
+uint64_t P_ALLOC_FAILS = 0;
 
-//physical pages including the physical page table itself
-//in addition to the kernel heap
-phy_page_t* P_PAGES_ALL = NULL;
-//physical pages not allocated for ptable or kernel heap
-uint64_t P_PAGES_OFFSET = 0;
+//pre-zeroed pages
+pfree_block_t* P_ZERO_POOL = NULL;
+uint64_t P_ZERO_COUNT = 0;
+//freed pages waiting to be zeroed
+pfree_block_t* P_DIRTY_POOL = NULL;
+uint64_t P_DIRTY_COUNT = 0;
+
+//frame database, free lists, pools and counters
+kspinlock_t P_LOCK = KSPINLOCK_INIT;
+
+//the level 1 translation table
+uint64_t* PT_L1 = NULL;
+//whether translation is enabled
+uint8_t MMU_ENABLED = 0;
 
 /**
  * Set the memory of some location
@@ -38,104 +134,481 @@ uint64_t P_PAGES_OFFSET = 0;
  * @param bytes the number of bytes to set
  */
 void memset(void *dest, uint8_t c, uint64_t bytes) {
-  uint64_t *d = (uint64_t *)dest;
+  uint8_t *d = (uint8_t *)dest;
+
+  //set leading bytes until aligned
+  while (bytes && ((uint64_t) d & 7)) {
+    *d++ = c;
+    bytes--;
+  }
+
+  //set whole words
+  uint64_t word = c * 0x0101010101010101;
+  uint64_t *dw = (uint64_t *)d;
+  for (; bytes >= 8; bytes -= 8) {
+    *dw++ = word;
+  }
+
+  //set trailing bytes
+  d = (uint8_t *)dw;
   while (bytes--) {
     *d++ = c;
   }
 }
 
+static inline uint8_t map_test(uint64_t *map, uint64_t pidx) {
+  return (map[pidx / MAP_WORD_BITS] >> (pidx % MAP_WORD_BITS)) & 1;
+}
+
+static inline void map_set(uint64_t *map, uint64_t pidx) {
+  map[pidx / MAP_WORD_BITS] |= 1UL << (pidx % MAP_WORD_BITS);
+}
+
+static inline void map_clear(uint64_t *map, uint64_t pidx) {
+  map[pidx / MAP_WORD_BITS] &= ~(1UL << (pidx % MAP_WORD_BITS));
+}
+
+/**
+ * Set a run of bits, a word at a time where possible
+ * @param map   the bitmap
+ * @param pidx  the first page
+ * @param count the number of pages
+ */
+static void map_set_range(uint64_t *map, uint64_t pidx, uint64_t count) {
+  uint64_t end = pidx + count;
+  while ((pidx < end) && (pidx % MAP_WORD_BITS)) {
+    map_set(map,pidx++);
+  }
+  while ((end - pidx) >= MAP_WORD_BITS) {
+    map[pidx / MAP_WORD_BITS] = ~0UL;
+    pidx += MAP_WORD_BITS;
+  }
+  while (pidx < end) {
+    map_set(map,pidx++);
+  }
+}
+
+/**
+ * Find the next page at or after pidx whose bit matches
+ * Scans a word at a time (rbit/clz)
+ * @param  map   the bitmap
+ * @param  pidx  the page to start at
+ * @param  set   whether to look for a set or a clear bit
+ * @return       the page index, P_PAGES_COUNT if none
+ */
+static uint64_t map_find(uint64_t *map, uint64_t pidx, uint8_t set) {
+  while (pidx < P_PAGES_COUNT) {
+    uint64_t word = map[pidx / MAP_WORD_BITS];
+    if (!set) {
+      word = ~word;
+    }
+    //ignore bits below the start
+    word &= ~0UL << (pidx % MAP_WORD_BITS);
+
+    if (word) {
+      pidx = (pidx & ~(uint64_t)(MAP_WORD_BITS - 1)) + __builtin_ctzl(word);
+      return pidx < P_PAGES_COUNT ? pidx : P_PAGES_COUNT;
+    }
+    pidx = (pidx & ~(uint64_t)(MAP_WORD_BITS - 1)) + MAP_WORD_BITS;
+  }
+  return P_PAGES_COUNT;
+}
+
+/**
+ * Add a block to the free list for its order
+ * @param pidx  the index of the first page in the block
+ * @param order the order of the block
+ */
+static void buddy_push(uint64_t pidx, uint8_t order) {
+  pfree_block_t* block = (pfree_block_t*) (pidx * PAGE_SIZE_B);
+  block->order = order;
+  block->prev = NULL;
+  block->next = P_FREE_AREAS[order];
+  if (block->next != NULL) {
+    block->next->prev = block;
+  }
+  P_FREE_AREAS[order] = block;
+  P_PAGES_FREE += 1UL << order;
+
+  map_set(P_BUDDY_MAP,pidx);
+}
+
+/**
+ * Remove a block from the free list for its order
+ * @param pidx  the index of the first page in the block
+ * @param order the order of the block
+ */
+static void buddy_remove(uint64_t pidx, uint8_t order) {
+  pfree_block_t* block = (pfree_block_t*) (pidx * PAGE_SIZE_B);
+  if (block->prev != NULL) {
+    block->prev->next = block->next;
+  } else {
+    P_FREE_AREAS[order] = block->next;
+  }
+  if (block->next != NULL) {
+    block->next->prev = block->prev;
+  }
+  P_PAGES_FREE -= 1UL << order;
+
+  map_clear(P_BUDDY_MAP,pidx);
+}
+
+/**
+ * Release a run of free pages into the largest aligned buddy blocks
+ * @param pidx  the first page
+ * @param end   the page after the last
+ */
+static void buddy_release_range(uint64_t pidx, uint64_t end) {
+  while (pidx < end) {
+    uint8_t order = P_MAX_ORDER;
+    while ((pidx & ((1UL << order) - 1)) ||
+           ((pidx + (1UL << order)) > end)) {
+      order--;
+    }
+    buddy_push(pidx,order);
+    pidx += 1UL << order;
+  }
+}
+
 /**
  * initialize the memory management sytem
- * @param phy_size the size of physical memory
+ * @param phy_size the size of physical memory usable by the ARM
  * @return the starting address of the kernel heap
  */
 uint64_t init_mmu(uint64_t phy_size) {
+  //memory at and above the peripheral window is not ram
+  if (phy_size > PERIPH_BASE) {
+    phy_size = PERIPH_BASE;
+  }
+
   //the number of pages that can be allocated
-  uint64_t p_pages = (phy_size / PAGE_SIZE_B) - 1;
+  P_PAGES_COUNT = phy_size / PAGE_SIZE_B;
 
-  //the size of the page table in memory
-  uint64_t p_pages_s = p_pages * sizeof(phy_page_t);
+  //the size of each bitmap in memory (whole words)
+  uint64_t map_words = (P_PAGES_COUNT + MAP_WORD_BITS - 1) / MAP_WORD_BITS;
+  uint64_t map_s = map_words * sizeof(uint64_t);
 
-  //Page table linkedlist resides in memory after the kernel stack
-  P_PAGES_ALL = (phy_page_t *)((uint64_t)&__end + K_STACK_SIZE_B);
-  memset(P_PAGES_ALL, 0, p_pages_s);
+  //frame database resides in memory after the kernel stack
+  P_ALLOC_MAP = (uint64_t *)((uint64_t)&__end + K_STACK_SIZE_B);
+  P_BUDDY_MAP = P_ALLOC_MAP + map_words;
+  P_KERNEL_MAP = P_BUDDY_MAP + map_words;
+  P_KHEAP_MAP = P_KERNEL_MAP + map_words;
+  P_ORDER_MAP = (uint8_t*) (P_KHEAP_MAP + map_words);
+  memset(P_ALLOC_MAP, 0, (map_s * 4) + P_PAGES_COUNT);
 
-  //calculate where the physical page table ends in memory
-  uint64_t p_pages_arr_end = (uint64_t) P_PAGES_ALL + p_pages_s;
+  //calculate where the frame database ends in memory
+  uint64_t p_maps_end = (uint64_t) P_ORDER_MAP + P_PAGES_COUNT;
   //round up to page size
-  if (p_pages_arr_end % PAGE_SIZE_B) {
+  if (p_maps_end % PAGE_SIZE_B) {
     //add the difference
-    p_pages_arr_end += PAGE_SIZE_B - (p_pages_arr_end % PAGE_SIZE_B);
+    p_maps_end += PAGE_SIZE_B - (p_maps_end % PAGE_SIZE_B);
   }
 
-  //the number of pages that are allocated for the page table itself
-  uint64_t ptable_pages = p_pages_arr_end / PAGE_SIZE_B;
-
-  //index of current page
-  uint64_t pidx = 0;
+  //the number of pages used by the kernel image and the frame database
+  uint64_t ptable_pages = p_maps_end / PAGE_SIZE_B;
 
-  //allocate pages needed to store metadata
-  for (pidx=0; pidx<ptable_pages; pidx++) {
-    P_PAGES_ALL[pidx].flags = FLAG_ALLOCATED | FLAG_KERNEL;
-    P_PAGES_ALL[pidx].addr = p_pages_arr_end + (pidx * PAGE_SIZE_B);
-  }
-
-  //allocate pages for the kernel heap
+  //pages for the kernel heap
   uint64_t kheap_pages = K_HEAP_SIZE_B / PAGE_SIZE_B;
 
-  //allocate the kernel heap
-  for (; pidx<(ptable_pages + kheap_pages); pidx++) {
-    P_PAGES_ALL[pidx].flags = FLAG_ALLOCATED | FLAG_KHEAP | FLAG_KERNEL;
-    P_PAGES_ALL[pidx].addr = p_pages_arr_end + (pidx * PAGE_SIZE_B);
-  }
+  map_set_range(P_KERNEL_MAP, 0, ptable_pages + kheap_pages);
+  map_set_range(P_KHEAP_MAP, ptable_pages, kheap_pages);
 
-  //set the start of the non kernel pages
-  P_PAGES_OFFSET = pidx;
+  for (uint8_t o=0; o<=P_MAX_ORDER; o++) {
+    P_FREE_AREAS[o] = NULL;
+  }
 
-  //setup metadata for remaining physical pages
-  for (; pidx<p_pages; pidx++) {
-    P_PAGES_ALL[pidx].flags = 0;
-    P_PAGES_ALL[pidx].addr = p_pages_arr_end + (pidx * PAGE_SIZE_B);
+  //release each run of non kernel pages to the buddy allocator
+  uint64_t pidx = map_find(P_KERNEL_MAP, 0, 0);
+  while (pidx < P_PAGES_COUNT) {
+    uint64_t end = map_find(P_KERNEL_MAP, pidx, 1);
+    buddy_release_range(pidx,end);
+    pidx = map_find(P_KERNEL_MAP, end, 0);
   }
 
   //starting offset of the kernel heap
-  return p_pages_arr_end;
+  return p_maps_end;
 }
 
 /**
- * Allocate a page
+ * Take a block of 2^order contiguous pages from the buddy allocator
+ * @param order the order of the block
+ * @return the address of the first page (not cleared)
  */
-void* palloc() {
-  phy_page_t* curr = &P_PAGES_ALL[P_PAGES_OFFSET];
+static void* buddy_alloc(uint8_t order) {
+  if (order > P_MAX_ORDER) {
+    return NULL;
+  }
 
-  //look for a free page
-  while ((curr != NULL) && (curr->flags & FLAG_ALLOCATED)) {
+  //find the smallest free block that fits
+  uint8_t curr = order;
+  while ((curr <= P_MAX_ORDER) && (P_FREE_AREAS[curr] == NULL)) {
     curr++;
   }
 
-  if (curr == NULL) {
-    set_errno(ERRNO_PALLOC);
+  if (curr > P_MAX_ORDER) {
     return NULL;
   }
 
-  if (curr->addr == 0) {
-    debug_err("page virtual address was 0");
+  uint64_t pidx = (uint64_t) P_FREE_AREAS[curr] / PAGE_SIZE_B;
+  buddy_remove(pidx,curr);
+
+  //split, returning the upper halves to the free lists
+  while (curr > order) {
+    curr--;
+    buddy_push(pidx + (1UL << curr),curr);
+  }
+
+  //set block allocated
+  map_set(P_ALLOC_MAP,pidx);
+  P_ORDER_MAP[pidx] = order;
+
+  return (void*) (pidx * PAGE_SIZE_B);
+}
+
+/**
+ * Take a block from the buddy allocator, asking the kernel
+ * heap to give back free regions if memory is short
+ * @param order the order of the block
+ * @return the address of the first page (not cleared)
+ */
+static void* buddy_alloc_reclaim(uint8_t order) {
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  void *memory = buddy_alloc(order);
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+
+  //the heap returns regions through pfree_order so it is asked unlocked
+  if ((memory == NULL) && (order <= P_MAX_ORDER) && kheap_trim()) {
+    flags = kspin_lock_irqsave(&P_LOCK);
+    memory = buddy_alloc(order);
+    kspin_unlock_irqrestore(&P_LOCK,flags);
+  }
+  return memory;
+}
+
+/**
+ * Check that a page heads an allocated block of an order that can be freed
+ * @param  pidx  the page index
+ * @param  order the order the caller frees it with
+ * @return       1 if the page can be freed
+ */
+static uint8_t pfree_valid(uint64_t pidx, uint8_t order) {
+  if ((pidx >= P_PAGES_COUNT) ||
+      map_test(P_KERNEL_MAP,pidx) ||
+      !map_test(P_ALLOC_MAP,pidx)) {
+    debug_err("pfree on page that is not allocated");
+    return 0;
+  }
+  //a wrong order would merge pages still in use into the free lists
+  if (P_ORDER_MAP[pidx] != order) {
+    debug_err("pfree with a different order than allocated");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Pop a page from a page pool (still marked free)
+ * @param  pool  the pool
+ * @param  count the pool size
+ * @return       the page, NULL if empty
+ */
+static void* ppool_pop(pfree_block_t **pool, uint64_t *count) {
+  pfree_block_t *page = *pool;
+  if (page != NULL) {
+    *pool = page->next;
+    (*count)--;
+  }
+  return page;
+}
+
+/**
+ * Push a page to a page pool
+ * Pooled pages are marked free so a second pfree() is rejected
+ * @param pool  the pool
+ * @param count the pool size
+ * @param page  the page
+ */
+static void ppool_push(pfree_block_t **pool, uint64_t *count, void *page) {
+  map_clear(P_ALLOC_MAP,(uint64_t) page / PAGE_SIZE_B);
+  ((pfree_block_t*) page)->next = *pool;
+  *pool = (pfree_block_t*) page;
+  (*count)++;
+}
+
+/**
+ * Account for pages handed out
+ * @param pages the number of pages
+ */
+static inline void pstat_alloc(uint64_t pages) {
+  P_ALLOC_CALLS++;
+  P_PAGES_USED += pages;
+  if (P_PAGES_USED > P_PAGES_PEAK) {
+    P_PAGES_PEAK = P_PAGES_USED;
+  }
+}
+
+/**
+ * Account for pages given back
+ * @param pages the number of pages
+ */
+static inline void pstat_free(uint64_t pages) {
+  P_FREE_CALLS++;
+  P_PAGES_USED -= pages;
+}
+
+/**
+ * Log an allocation failure
+ */
+static void palloc_fail() {
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  P_ALLOC_FAILS++;
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+  debug_log("palloc out of pages");
+  debug_mmu();
+  set_errno(ERRNO_PALLOC);
+}
+
+/**
+ * Allocate a block of 2^order contiguous pages without clearing it
+ * For callers that overwrite or track what they use
+ * @param order the order of the block
+ * @return the address of the first page
+ */
+void* palloc_order_nozero(uint8_t order) {
+  void *memory = buddy_alloc_reclaim(order);
+  if (memory == NULL) {
+    palloc_fail();
     return NULL;
   }
 
-  //set page allocated
-  curr->flags = curr->flags | FLAG_ALLOCATED;
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  pstat_alloc(1UL << order);
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+  return memory;
+}
+
+/**
+ * Allocate a block of 2^order contiguous pages
+ * @param order the order of the block
+ * @return the address of the first page
+ */
+void* palloc_order(uint8_t order) {
+  void *memory = palloc_order_nozero(order);
 
-  //get address of memory, clear
-  void *memory = (void*) curr->addr;
-  memset(memory, 0, PAGE_SIZE_B);
+  //clear the memory
+  if (memory != NULL) {
+    memset(memory, 0, PAGE_SIZE_B << order);
+  }
 
   //return the allocated memory
   return memory;
 }
 
+/**
+ * Return a block to the buddy allocator (P_LOCK held)
+ * @param addr  the address of the first page
+ * @param order the order the block was allocated with
+ */
+static void pfree_block(void *addr, uint8_t order) {
+  //locate page in frame database
+  uint64_t pidx = (uint64_t)addr / PAGE_SIZE_B;
+  if (!pfree_valid(pidx,order)) {
+    return;
+  }
+
+  //mark free
+  map_clear(P_ALLOC_MAP,pidx);
+  pstat_free(1UL << order);
+
+  //merge with the buddy while it is free at the same order
+  while (order < P_MAX_ORDER) {
+    uint64_t buddy = pidx ^ (1UL << order);
+    if ((buddy >= P_PAGES_COUNT) ||
+        !map_test(P_BUDDY_MAP,buddy) ||
+        (((pfree_block_t*) (buddy * PAGE_SIZE_B))->order != order)) {
+      break;
+    }
+    buddy_remove(buddy,order);
+    pidx = pidx & ~(1UL << order);
+    order++;
+  }
+
+  buddy_push(pidx,order);
+}
+
+/**
+ * Free a block of 2^order contiguous pages
+ * @param addr  the address of the first page
+ * @param order the order the block was allocated with
+ */
+void pfree_order(void *addr, uint8_t order) {
+  if (addr == NULL) {
+    return;
+  }
+
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  pfree_block(addr,order);
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+}
+
+/**
+ * Allocate a zeroed page
+ * Served from the pre-zeroed pool when possible
+ */
+void* palloc() {
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  void *page = ppool_pop(&P_ZERO_POOL,&P_ZERO_COUNT);
+  if (page != NULL) {
+    //the pool link is the only non zero word
+    ((pfree_block_t*) page)->next = NULL;
+    map_set(P_ALLOC_MAP,(uint64_t) page / PAGE_SIZE_B);
+    pstat_alloc(1);
+  }
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+
+  if (page != NULL) {
+    return page;
+  }
+  return palloc_order(0);
+}
+
+/**
+ * Allocate a page without clearing it
+ * For callers that overwrite the whole page
+ */
+void* palloc_nozero() {
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  void *page = ppool_pop(&P_DIRTY_POOL,&P_DIRTY_COUNT);
+  if (page != NULL) {
+    map_set(P_ALLOC_MAP,(uint64_t) page / PAGE_SIZE_B);
+  }
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+
+  if (page == NULL) {
+    page = buddy_alloc_reclaim(0);
+  }
+
+  flags = kspin_lock_irqsave(&P_LOCK);
+  if (page == NULL) {
+    page = ppool_pop(&P_ZERO_POOL,&P_ZERO_COUNT);
+    if (page != NULL) {
+      map_set(P_ALLOC_MAP,(uint64_t) page / PAGE_SIZE_B);
+    }
+  }
+  if (page != NULL) {
+    pstat_alloc(1);
+  }
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+
+  if (page == NULL) {
+    palloc_fail();
+  }
+  return page;
+}
+
 /**
  * Free an allocated page
+ * The page is kept for zeroing while the zero pool is low
  * @param addr the address of the page
  */
 void pfree(void *addr) {
@@ -143,8 +616,394 @@ void pfree(void *addr) {
     return;
   }
 
-  //locate page in ptable
-  phy_page_t *page = P_PAGES_ALL + ((uint64_t)addr / PAGE_SIZE_B);
-  //mark free
-  page->flags = page->flags & ~FLAG_ALLOCATED;
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  if ((P_ZERO_COUNT + P_DIRTY_COUNT) < P_ZERO_POOL_TARGET) {
+    if (pfree_valid((uint64_t)addr / PAGE_SIZE_B,0)) {
+      ppool_push(&P_DIRTY_POOL,&P_DIRTY_COUNT,addr);
+      pstat_free(1);
+    }
+  } else {
+    pfree_block(addr,0);
+  }
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+}
+
+/**
+ * Zero one page for the zero pool
+ * Called from the idle thread
+ * @return 1 if a page was zeroed, 0 if the pool is full
+ */
+uint8_t pzero_work() {
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  void *page = ppool_pop(&P_DIRTY_POOL,&P_DIRTY_COUNT);
+  if ((page == NULL) && (P_ZERO_COUNT < P_ZERO_POOL_TARGET)) {
+    page = buddy_alloc(0);
+    //not handed out, it stays free while it is cleared
+    if (page != NULL) {
+      map_clear(P_ALLOC_MAP,(uint64_t) page / PAGE_SIZE_B);
+    }
+  }
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+  if (page == NULL) {
+    return 0;
+  }
+
+  //the page belongs to no one while it is cleared
+  memset(page, 0, PAGE_SIZE_B);
+
+  flags = kspin_lock_irqsave(&P_LOCK);
+  ppool_push(&P_ZERO_POOL,&P_ZERO_COUNT,page);
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+  return 1;
+}
+
+/**
+ * Take a free page out of the buddy allocator, splitting
+ * the free block that contains it
+ * @param  pidx the page index
+ * @return      0 on success, pos if the page is not free
+ */
+static uint8_t buddy_reserve_page(uint64_t pidx) {
+  //a free block containing the page is found at its own order first
+  for (int o=P_MAX_ORDER; o>=0; o--) {
+    uint64_t head = pidx & ~((1UL << o) - 1);
+    if (map_test(P_BUDDY_MAP,head) &&
+        (((pfree_block_t*) (head * PAGE_SIZE_B))->order == (uint64_t) o)) {
+      buddy_remove(head,o);
+
+      //return the halves that do not contain the page
+      while (o > 0) {
+        o--;
+        uint64_t half = head + (1UL << o);
+        if (pidx >= half) {
+          buddy_push(head,o);
+          head = half;
+        } else {
+          buddy_push(half,o);
+        }
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Reserve a range of physical memory so that it is never allocated
+ * Memory outside of the managed range is ignored
+ * @param addr the start of the range
+ * @param size the size of the range in bytes
+ * @return     0 on success, pos if part of the range is in use
+ */
+uint8_t palloc_reserve(uint64_t addr, uint64_t size) {
+  uint8_t status = 0;
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  uint64_t end = (addr + size + PAGE_SIZE_B - 1) / PAGE_SIZE_B;
+
+  for (uint64_t pidx=addr / PAGE_SIZE_B; (pidx<end) && (pidx<P_PAGES_COUNT); pidx++) {
+    if (map_test(P_KERNEL_MAP,pidx)) {
+      continue;
+    }
+    if (buddy_reserve_page(pidx)) {
+      status = 1;
+    } else {
+      map_set(P_KERNEL_MAP,pidx);
+    }
+  }
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+  return status;
+}
+
+/**
+ * Get the page allocator counters
+ * @param stats the counters (set)
+ */
+void palloc_get_stats(palloc_stats_t *stats) {
+  uint64_t flags = kspin_lock_irqsave(&P_LOCK);
+  stats->pages_total = P_PAGES_COUNT;
+  stats->pages_free = P_PAGES_FREE;
+  stats->pages_pooled = P_ZERO_COUNT + P_DIRTY_COUNT;
+  stats->pages_used = P_PAGES_USED;
+  stats->pages_peak = P_PAGES_PEAK;
+  stats->allocs = P_ALLOC_CALLS;
+  stats->frees = P_FREE_CALLS;
+  stats->fails = P_ALLOC_FAILS;
+  stats->largest_order = 0;
+  stats->frag_pct = 0;
+
+  //walk the free lists
+  for (uint8_t o=0; o<=P_MAX_ORDER; o++) {
+    stats->free_blocks[o] = 0;
+    for (pfree_block_t *curr=P_FREE_AREAS[o]; curr!=NULL; curr=curr->next) {
+      stats->free_blocks[o]++;
+    }
+    if (stats->free_blocks[o]) {
+      stats->largest_order = o;
+    }
+  }
+
+  //free pages outside max order blocks (those are never fragmented)
+  if (P_PAGES_FREE > 0) {
+    uint64_t whole = stats->free_blocks[P_MAX_ORDER] << P_MAX_ORDER;
+    stats->frag_pct = 100 - ((whole * 100) / P_PAGES_FREE);
+  }
+  kspin_unlock_irqrestore(&P_LOCK,flags);
+}
+
+/**
+ * Show debug info
+ */
+void debug_mmu() {
+  palloc_stats_t stats;
+  palloc_get_stats(&stats);
+
+  debug_val("pages_total",stats.pages_total);
+  debug_val("pages_free",stats.pages_free);
+  debug_val("pages_zero_pool",P_ZERO_COUNT);
+  debug_val("pages_dirty_pool",P_DIRTY_COUNT);
+  debug_val("pages_used",stats.pages_used);
+  debug_val("pages_peak",stats.pages_peak);
+  debug_val("pages_largest_order",stats.largest_order);
+  debug_val("pages_frag_pct",stats.frag_pct);
+  debug_val("palloc_calls",stats.allocs);
+  debug_val("pfree_calls",stats.frees);
+  debug_val("palloc_fails",stats.fails);
+
+  for (uint8_t o=0; o<=P_MAX_ORDER; o++) {
+    if (stats.free_blocks[o]) {
+      debug_val("free_order",o);
+      debug_val(" blocks",stats.free_blocks[o]);
+    }
+  }
+}
+
+/**
+ * Clean and invalidate the data cache for a range of memory
+ * (to the point of coherency)
+ * @param addr the start of the range
+ * @param size the size of the range in bytes
+ */
+void dcache_flush_range(void *addr, uint64_t size) {
+#ifdef KHOST
+  //host builds (make host-test) have no cache maintenance to do
+  (void) addr;
+  (void) size;
+#else
+  uint64_t ctr;
+  asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+  //smallest data cache line in bytes
+  uint64_t line = 4UL << ((ctr >> 16) & 0xF);
+
+  uint64_t end = (uint64_t) addr + size;
+  for (uint64_t a=(uint64_t) addr & ~(line - 1); a<end; a+=line) {
+    asm volatile("dc civac, %0" :: "r"(a) : "memory");
+  }
+  asm volatile("dsb sy" ::: "memory");
+#endif
+}
+
+/**
+ * Get the descriptor bits for a memory type
+ * @param  type MMU_NORMAL, MMU_DEVICE or MMU_WC (with MMU_BLOCK)
+ * @return      the lower and upper attributes
+ */
+static uint64_t pt_attrs(uint8_t type) {
+  if ((type & ~MMU_BLOCK) == MMU_DEVICE) {
+    return PT_ATTR(MAIR_IDX_DEVICE_nGnRE) | PT_AF | PT_PXN | PT_UXN;
+  } else if ((type & ~MMU_BLOCK) == MMU_WC) {
+    return PT_ATTR(MAIR_IDX_NORMAL_NC) | PT_SH_INNER | PT_AF |
+           PT_PXN | PT_UXN;
+  }
+  return PT_ATTR(MAIR_IDX_NORMAL) | PT_SH_INNER | PT_AF;
+}
+
+/**
+ * Invalidate all stage 1 EL1 tlb entries
+ */
+static void tlb_flush_all() {
+#ifndef KHOST
+  asm volatile("dsb ishst\n"
+               "tlbi vmalle1is\n"
+               "dsb ish\n"
+               "isb" ::: "memory");
+#endif
+}
+
+/**
+ * Replace a level 2 block with a level 3 table mapping the
+ * same memory with the same attributes
+ * @param  l2  the level 2 table
+ * @param  idx the index of the block entry
+ * @return     0 on success, pos on error
+ */
+static uint8_t pt_split_block(uint64_t *l2, uint64_t idx) {
+  //every entry is written below
+  uint64_t *l3 = (uint64_t*) palloc_nozero();
+  if (l3 == NULL) {
+    return 1;
+  }
+
+  uint64_t block = l2[idx];
+  uint64_t pa = block & PT_BLOCK_ADDR_MASK;
+  uint64_t attrs = block & ~PT_BLOCK_ADDR_MASK & ~PT_TYPE_MASK;
+  for (uint64_t i=0; i<PT_ENTRIES; i++) {
+    l3[i] = (pa + (i * PAGE_SIZE_B)) | attrs | PT_PAGE;
+  }
+
+  if (MMU_ENABLED) {
+    //break before make, the block must not be the one we are running from
+    l2[idx] = 0;
+    tlb_flush_all();
+  }
+  l2[idx] = (uint64_t) l3 | PT_TABLE;
+  return 0;
+}
+
+/**
+ * Get the next level table referenced by an entry, creating it if needed
+ * (a level 2 block entry is split into pages)
+ * @param  table the table containing the entry
+ * @param  idx   the index of the entry
+ * @return       the next level table, NULL on error
+ */
+static uint64_t* pt_next_table(uint64_t *table, uint64_t idx) {
+  if (!(table[idx] & PT_VALID)) {
+    uint64_t *next = (uint64_t*) palloc();
+    if (next == NULL) {
+      return NULL;
+    }
+    table[idx] = (uint64_t) next | PT_TABLE;
+  } else if ((table[idx] & PT_TYPE_MASK) == PT_BLOCK) {
+    if (pt_split_block(table,idx)) {
+      return NULL;
+    }
+  }
+  return (uint64_t*) (table[idx] & PT_ADDR_MASK);
+}
+
+/**
+ * Map a region of virtual memory to physical memory
+ * With MMU_BLOCK, 2MB aligned parts of the region are mapped with
+ * level 2 blocks and only the unaligned edges use 4KB pages
+ * @param va   the virtual address of the region
+ * @param pa   the physical address of the region
+ * @param size the size of the region in bytes
+ * @param type MMU_NORMAL, MMU_DEVICE or MMU_WC, optionally with MMU_BLOCK
+ * @return     0 on success, pos on error
+ */
+uint8_t mmu_map_region(uint64_t va,
+                       uint64_t pa,
+                       uint64_t size,
+                       uint8_t type) {
+  if (PT_L1 == NULL) {
+    PT_L1 = (uint64_t*) palloc();
+    if (PT_L1 == NULL) {
+      set_errno(ERRNO_MMU);
+      return 1;
+    }
+  }
+
+  uint64_t attrs = pt_attrs(type);
+  uint64_t end = va + size;
+  va = va & ~(uint64_t)(PAGE_SIZE_B - 1);
+  pa = pa & ~(uint64_t)(PAGE_SIZE_B - 1);
+
+  while (va < end) {
+    uint64_t *l2 = pt_next_table(PT_L1, PT_L1_IDX(va));
+    if (l2 == NULL) {
+      set_errno(ERRNO_MMU);
+      return 1;
+    }
+
+    //map a whole 2MB block if aligned
+    if ((type & MMU_BLOCK) &&
+        !(va % PT_BLOCK_SIZE) && !(pa % PT_BLOCK_SIZE) &&
+        ((end - va) >= PT_BLOCK_SIZE)) {
+      uint64_t prev = l2[PT_L2_IDX(va)];
+      uint64_t block = pa | attrs | PT_BLOCK;
+
+      //break before make, another core may hold the old walk in its tlb
+      if (MMU_ENABLED && (prev & PT_VALID) && (prev != block)) {
+        l2[PT_L2_IDX(va)] = 0;
+        tlb_flush_all();
+      }
+      l2[PT_L2_IDX(va)] = block;
+
+      //release a level 3 table replaced by the block (no longer walked)
+      if ((prev & PT_TYPE_MASK) == PT_TABLE) {
+        pfree((void*) (prev & PT_ADDR_MASK));
+      }
+
+      va += PT_BLOCK_SIZE;
+      pa += PT_BLOCK_SIZE;
+      continue;
+    }
+
+    uint64_t *l3 = pt_next_table(l2, PT_L2_IDX(va));
+    if (l3 == NULL) {
+      set_errno(ERRNO_MMU);
+      return 1;
+    }
+
+    l3[PT_L3_IDX(va)] = pa | attrs | PT_PAGE;
+    va += PAGE_SIZE_B;
+    pa += PAGE_SIZE_B;
+  }
+
+  if (MMU_ENABLED) {
+    tlb_flush_all();
+  }
+  return 0;
+}
+
+/**
+ * Identity map physical memory and peripherals, enable the mmu and caches
+ * @param phy_size the size of physical memory usable by the ARM
+ * @return 0 on success, pos on error
+ */
+uint8_t mmu_enable(uint64_t phy_size) {
+  //normal memory stops at the peripheral window
+  uint64_t ram_size = phy_size < PERIPH_BASE ? phy_size : PERIPH_BASE;
+
+  //kernel image, heap and pages are covered by 2MB blocks
+  if (mmu_map_region(0, 0, ram_size, MMU_NORMAL | MMU_BLOCK) ||
+      mmu_map_region(PERIPH_BASE, PERIPH_BASE, PERIPH_SIZE,
+                     MMU_DEVICE | MMU_BLOCK) ||
+      mmu_map_region(LOCAL_PERIPH_BASE, LOCAL_PERIPH_BASE,
+                     LOCAL_PERIPH_SIZE, MMU_DEVICE | MMU_BLOCK)) {
+    debug_err("failed to build translation tables");
+    return 1;
+  }
+
+  mmu_enable_core();
+  MMU_ENABLED = 1;
+  //memory is normal cacheable now, exclusives work
+  kspin_use_exclusives();
+
+  //secondary cores read the table base before their caches are on
+  dcache_flush_range(&PT_L1,sizeof(PT_L1));
+  return 0;
+}
+
+/**
+ * Enable the mmu and caches on the calling core with the
+ * translation tables built by mmu_enable()
+ */
+void mmu_enable_core() {
+#ifndef KHOST
+  asm volatile("msr mair_el1, %0\n"
+               "msr tcr_el1, %1\n"
+               "msr ttbr0_el1, %2\n"
+               "isb\n"
+               "tlbi vmalle1\n"
+               "dsb nsh\n"
+               "isb"
+               :: "r"(MAIR_VALUE), "r"(TCR_VALUE), "r"(PT_L1) : "memory");
+
+  uint64_t sctlr;
+  asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+  sctlr = sctlr | SCTLR_M | SCTLR_C | SCTLR_I;
+  asm volatile("msr sctlr_el1, %0\n"
+               "isb" :: "r"(sctlr) : "memory");
+#endif
 }
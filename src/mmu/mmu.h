@@ -19,10 +19,52 @@
  */
 #define K_STACK_SIZE_B 4096
 /*
- * Kernel heap size
- * 4MB
+ * Initial kernel heap size
+ * 1MB (grows with pages on demand)
  */
-#define K_HEAP_SIZE_B 4194304
+#define K_HEAP_SIZE_B 1048576
+/*
+ * Largest buddy block order
+ * 2^10 pages (4MB)
+ */
+#define P_MAX_ORDER 10
+
+/*
+ * Memory types for mmu_map_region()
+ */
+//normal memory, write-back cacheable
+#define MMU_NORMAL 0
+//device memory (nGnRE)
+#define MMU_DEVICE 1
+//normal non-cacheable memory, stores may be merged (write-combining)
+#define MMU_WC     2
+//flag: map 2MB aligned parts of the region with block descriptors
+#define MMU_BLOCK  0x80
+
+/*
+ * Page allocator counters
+ */
+typedef struct palloc_stats_t {
+  //pages managed by the allocator
+  uint64_t pages_total;
+  //pages held by the buddy allocator
+  uint64_t pages_free;
+  //pages held by the zero and dirty pools
+  uint64_t pages_pooled;
+  //pages handed out by palloc (and its high-water mark)
+  uint64_t pages_used;
+  uint64_t pages_peak;
+  //free blocks by order
+  uint64_t free_blocks[P_MAX_ORDER + 1];
+  //the order of the largest free block
+  uint64_t largest_order;
+  //external fragmentation, percent of free pages outside max order blocks
+  uint64_t frag_pct;
+  //allocation and free calls, failed allocations
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t fails;
+} palloc_stats_t;
 
 /**
  * Set the memory of some location
@@ -34,20 +76,113 @@ void memset(void *dest, uint8_t c, uint64_t bytes);
 
 /**
  * initialize the memory management sytem
- * @param phy_size the size of physical memory
+ * @param phy_size the size of physical memory usable by the ARM
  * @return the starting address of the kernel heap
  */
 uint64_t init_mmu(uint64_t phy_size);
 
 /**
- * Allocate a page
+ * Allocate a block of 2^order contiguous pages
+ * @param order the order of the block
+ * @return the address of the first page
+ */
+void* palloc_order(uint8_t order);
+
+/**
+ * Allocate a block of 2^order contiguous pages without clearing it
+ * For callers that overwrite or track what they use
+ * @param order the order of the block
+ * @return the address of the first page
+ */
+void* palloc_order_nozero(uint8_t order);
+
+/**
+ * Free a block of 2^order contiguous pages
+ * @param addr  the address of the first page
+ * @param order the order the block was allocated with
+ */
+void pfree_order(void *addr, uint8_t order);
+
+/**
+ * Allocate a zeroed page
+ * Served from the pre-zeroed pool when possible
  */
 void* palloc();
 
+/**
+ * Allocate a page without clearing it
+ * For callers that overwrite the whole page
+ */
+void* palloc_nozero();
+
 /**
  * Free an allocated page
+ * The page is kept for zeroing while the zero pool is low
  * @param addr the address of the page
  */
 void pfree(void *addr);
 
+/**
+ * Reserve a range of physical memory so that it is never allocated
+ * Memory outside of the managed range is ignored
+ * @param addr the start of the range
+ * @param size the size of the range in bytes
+ * @return     0 on success, pos if part of the range is in use
+ */
+uint8_t palloc_reserve(uint64_t addr, uint64_t size);
+
+/**
+ * Zero one page for the zero pool
+ * Called from the idle thread
+ * @return 1 if a page was zeroed, 0 if the pool is full
+ */
+uint8_t pzero_work();
+
+/**
+ * Get the page allocator counters
+ * @param stats the counters (set)
+ */
+void palloc_get_stats(palloc_stats_t *stats);
+
+/**
+ * Show debug info
+ */
+void debug_mmu();
+
+/**
+ * Clean and invalidate the data cache for a range of memory
+ * (to the point of coherency)
+ * @param addr the start of the range
+ * @param size the size of the range in bytes
+ */
+void dcache_flush_range(void *addr, uint64_t size);
+
+/**
+ * Map a region of virtual memory to physical memory
+ * With MMU_BLOCK, 2MB aligned parts of the region are mapped with
+ * level 2 blocks and only the unaligned edges use 4KB pages
+ * @param va   the virtual address of the region
+ * @param pa   the physical address of the region
+ * @param size the size of the region in bytes
+ * @param type MMU_NORMAL, MMU_DEVICE or MMU_WC, optionally with MMU_BLOCK
+ * @return     0 on success, pos on error
+ */
+uint8_t mmu_map_region(uint64_t va,
+                       uint64_t pa,
+                       uint64_t size,
+                       uint8_t type);
+
+/**
+ * Identity map physical memory and peripherals, enable the mmu and caches
+ * @param phy_size the size of physical memory usable by the ARM
+ * @return 0 on success, pos on error
+ */
+uint8_t mmu_enable(uint64_t phy_size);
+
+/**
+ * Enable the mmu and caches on the calling core with the
+ * translation tables built by mmu_enable()
+ */
+void mmu_enable_core();
+
 #endif /*_MMU_MMU_H*/
@@ -6,6 +6,9 @@
 #define _SCHD_KPCB_H
 
 #include "cpu_context.h"
+#include "../mmu/karena.h"
+#include "krbtree.h"
+#include "kwait.h"
 
 //process state
 typedef struct kproc_state_t {
@@ -31,14 +34,20 @@ typedef enum kproc_stat {
  * Process control block for a kernel thread
  */
 typedef struct kpcb_t {
-  //process state (page in memory)
+  //process state
   kproc_state_t* state;
+  //the thread stack (page in memory)
+  void* stack;
   //parent process id
   uint64_t kppid;
   //kernel processid
   uint64_t kpid;
   //the priority of this process
   uint8_t priority;
+  //the priority it is queued at, moved one level by its interactivity
+  uint8_t run_priority;
+  //slices ended early (pos) or used up (neg), saturating
+  int8_t interactivity;
   //flags
   uint8_t flags;
   //the kprocess status
@@ -49,8 +58,39 @@ typedef struct kpcb_t {
   char **argv;
   //the process exit code
   uint8_t exit_code;
+  //scratch allocations freed when the process is reaped (optional)
+  karena_t* arena;
+  //the core whose run queue this process is on
+  uint8_t cpu;
+  //cores this process may run on (bit per core)
+  uint8_t affinity;
+  //set while a core is running on this process's stack
+  uint8_t on_cpu;
+  //set while the process is on its core's run queue
+  uint8_t on_rq;
+  //woken before it blocked, the next wait returns at once
+  uint8_t wake_pending;
+  //system count to wake at while in kthread_sleep_ms (0 otherwise)
+  uint64_t wake_at;
+  //next sleeping process on the same core
+  struct kpcb_t* sleep_next;
+  //the wait queue this process is on (NULL if none) and its neighbours
+  kwait_queue_t* wait_q;
+  struct kpcb_t* wait_next;
+  struct kpcb_t* wait_prev;
+  //woken when a child of this process exits (kwaitpid)
+  kwait_queue_t child_exit;
+  //niceness (-20 to 19) and the cpu share weight it maps to
+  int8_t nice;
+  uint32_t weight;
+  //cpu time scaled by weight, the fair policy runs the lowest first
+  uint64_t vruntime;
+  //system count when the process was last switched to or charged
+  uint64_t exec_start;
+  //fair policy run queue node
+  krb_node_t rb_node;
 
-  //linked list ptrs
+  //run queue ptrs
   struct kpcb_t* next;
   struct kpcb_t* prev;
 } kpcb_t;
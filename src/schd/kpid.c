@@ -0,0 +1,168 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "kpid.h"
+#include "../smp/spinlock.h"
+
+#define KPID_SLOT_MASK (KPID_SLOTS - 1)
+
+/*
+ * A process id slot
+ */
+typedef struct kpid_slot_t {
+  //the process (NULL while reserved or free)
+  kpcb_t* pcb;
+  //generation of the id currently using this slot
+  uint32_t gen;
+  //next free slot (free slots only)
+  uint32_t next_free;
+} kpid_slot_t;
+
+//end of the free slot list
+#define SLOT_NONE KPID_SLOTS
+
+kpid_slot_t KPID_TABLE[KPID_SLOTS];
+//free slots, lowest first at init then most recently freed
+uint32_t KPID_FREE = SLOT_NONE;
+//the free list and slot generations
+kspinlock_t KPID_LOCK = KSPINLOCK_INIT;
+
+/**
+ * Initialize the process id table
+ * The first id handed out is 0
+ */
+void init_kpid() {
+  for (uint32_t i=0; i<KPID_SLOTS; i++) {
+    KPID_TABLE[i].pcb = NULL;
+    KPID_TABLE[i].gen = 0;
+    KPID_TABLE[i].next_free = i + 1;
+  }
+  KPID_FREE = 0;
+}
+
+/**
+ * Reserve a process id
+ * @return the id, KPID_NONE if every slot is in use
+ */
+uint64_t kpid_alloc() {
+  uint64_t flags = kspin_lock_irqsave(&KPID_LOCK);
+  if (KPID_FREE == SLOT_NONE) {
+    kspin_unlock_irqrestore(&KPID_LOCK,flags);
+    return KPID_NONE;
+  }
+  uint32_t slot = KPID_FREE;
+  KPID_FREE = KPID_TABLE[slot].next_free;
+  KPID_TABLE[slot].pcb = NULL;
+  uint64_t kpid = ((uint64_t) KPID_TABLE[slot].gen << KPID_SLOT_BITS) | slot;
+  kspin_unlock_irqrestore(&KPID_LOCK,flags);
+  return kpid;
+}
+
+/**
+ * Attach a process to a reserved id
+ * @param kpid the id
+ * @param pcb  the process control block
+ */
+void kpid_bind(uint64_t kpid, kpcb_t* pcb) {
+  uint64_t flags = kspin_lock_irqsave(&KPID_LOCK);
+  KPID_TABLE[kpid & KPID_SLOT_MASK].pcb = pcb;
+  kspin_unlock_irqrestore(&KPID_LOCK,flags);
+}
+
+/**
+ * Return a slot to the free list (KPID_LOCK held)
+ * @param slot the slot
+ */
+static void slot_release(uint32_t slot) {
+  KPID_TABLE[slot].pcb = NULL;
+  KPID_TABLE[slot].gen++;
+  KPID_TABLE[slot].next_free = KPID_FREE;
+  KPID_FREE = slot;
+}
+
+/**
+ * Release a process id (stale copies of it stop resolving)
+ * @param kpid the id
+ */
+void kpid_free(uint64_t kpid) {
+  uint32_t slot = kpid & KPID_SLOT_MASK;
+  uint64_t flags = kspin_lock_irqsave(&KPID_LOCK);
+  //skip ids that were already freed
+  if ((kpid >> KPID_SLOT_BITS) == KPID_TABLE[slot].gen) {
+    slot_release(slot);
+  }
+  kspin_unlock_irqrestore(&KPID_LOCK,flags);
+}
+
+/**
+ * Find a process by id (KPID_LOCK held)
+ * @param  kpid the id
+ * @return      the process control block, NULL if not found
+ */
+static kpcb_t* slot_lookup(uint64_t kpid) {
+  kpcb_t* pcb = KPID_TABLE[kpid & KPID_SLOT_MASK].pcb;
+  if ((pcb != NULL) && (pcb->kpid != kpid)) {
+    pcb = NULL;
+  }
+  return pcb;
+}
+
+/**
+ * Find a process by id
+ * @param  kpid the id
+ * @return      the process control block, NULL if not found
+ */
+kpcb_t* kpid_lookup(uint64_t kpid) {
+  uint64_t flags = kspin_lock_irqsave(&KPID_LOCK);
+  kpcb_t* pcb = slot_lookup(kpid);
+  kspin_unlock_irqrestore(&KPID_LOCK,flags);
+  return pcb;
+}
+
+/**
+ * Read the state of a process by id
+ * The pcb is not freed while the id resolves (free_kproc releases it first)
+ * @param  kpid  the id
+ * @param  stat  the process state (set)
+ * @param  kppid the parent process id (set)
+ * @return       0 on success, pos if not found
+ */
+uint8_t kpid_stat(uint64_t kpid, kproc_stat* stat, uint64_t* kppid) {
+  uint64_t flags = kspin_lock_irqsave(&KPID_LOCK);
+  kpcb_t* pcb = slot_lookup(kpid);
+  if (pcb != NULL) {
+    *stat = __atomic_load_n(&pcb->stat,__ATOMIC_ACQUIRE);
+    *kppid = pcb->kppid;
+  }
+  kspin_unlock_irqrestore(&KPID_LOCK,flags);
+  return pcb == NULL;
+}
+
+/**
+ * Claim an exited process to reap it
+ * The process moves from waitable to zombied and its id is released
+ * in one step, so exactly one caller gets the pcb
+ * @param  kpid the id
+ * @param  pcb  the process control block (set when claimed)
+ * @return      0 if claimed, 1 if not found or not waitable,
+ *              2 if it has not exited
+ */
+uint8_t kpid_claim_exited(uint64_t kpid, kpcb_t** pcb) {
+  uint8_t status = 1;
+  uint64_t flags = kspin_lock_irqsave(&KPID_LOCK);
+  kpcb_t* found = slot_lookup(kpid);
+  if (found != NULL) {
+    kproc_stat stat = __atomic_load_n(&found->stat,__ATOMIC_ACQUIRE);
+    if (stat == PROC_WAITABLE) {
+      found->stat = PROC_ZOMBIED;
+      slot_release(kpid & KPID_SLOT_MASK);
+      *pcb = found;
+      status = 0;
+    } else if (stat != PROC_ZOMBIED) {
+      status = 2;
+    }
+  }
+  kspin_unlock_irqrestore(&KPID_LOCK,flags);
+  return status;
+}
@@ -0,0 +1,77 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _SCHD_KPID_H
+#define _SCHD_KPID_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "kpcb.h"
+
+/*
+ * Process ids index a fixed table of slots
+ * kpid = (generation << KPID_SLOT_BITS) | slot
+ * A slot's generation is bumped when it is freed so a stale
+ * kpid never matches the next process to reuse the slot
+ */
+#define KPID_SLOT_BITS 10
+#define KPID_SLOTS     (1 << KPID_SLOT_BITS)
+
+//no process id available
+#define KPID_NONE ((uint64_t) -1)
+
+/**
+ * Initialize the process id table
+ * The first id handed out is 0
+ */
+void init_kpid();
+
+/**
+ * Reserve a process id
+ * @return the id, KPID_NONE if every slot is in use
+ */
+uint64_t kpid_alloc();
+
+/**
+ * Attach a process to a reserved id
+ * @param kpid the id
+ * @param pcb  the process control block
+ */
+void kpid_bind(uint64_t kpid, kpcb_t* pcb);
+
+/**
+ * Release a process id (stale copies of it stop resolving)
+ * @param kpid the id
+ */
+void kpid_free(uint64_t kpid);
+
+/**
+ * Find a process by id
+ * @param  kpid the id
+ * @return      the process control block, NULL if not found
+ */
+kpcb_t* kpid_lookup(uint64_t kpid);
+
+/**
+ * Read the state of a process by id
+ * The pcb is not freed while the id resolves (free_kproc releases it first)
+ * @param  kpid  the id
+ * @param  stat  the process state (set)
+ * @param  kppid the parent process id (set)
+ * @return       0 on success, pos if not found
+ */
+uint8_t kpid_stat(uint64_t kpid, kproc_stat* stat, uint64_t* kppid);
+
+/**
+ * Claim an exited process to reap it
+ * The process moves from waitable to zombied and its id is released
+ * in one step, so exactly one caller gets the pcb
+ * @param  kpid the id
+ * @param  pcb  the process control block (set when claimed)
+ * @return      0 if claimed, 1 if not found or not waitable,
+ *              2 if it has not exited
+ */
+uint8_t kpid_claim_exited(uint64_t kpid, kpcb_t** pcb);
+
+#endif /*_SCHD_KPID_H*/
@@ -4,6 +4,8 @@
 
 #include "kproc.h"
 #include "kschd.h"
+#include "kpid.h"
+#include "kwait.h"
 #include "../uart/debug.h"
 
 /*
@@ -30,6 +32,21 @@ uint8_t WEXITSTAT(uint16_t status) {
   return (uint8_t) (status & STATUS_EXITCODE);
 }
 
+/**
+ * Check whether a process has exited
+ * @param  kpid the process id
+ * @return      1 if it exited (waitable or zombied) or was already reaped
+ */
+static uint8_t kproc_exited(uint64_t kpid) {
+  //read under the id lock, another waiter may free the pcb
+  kproc_stat stat;
+  uint64_t kppid;
+  if (kpid_stat(kpid,&stat,&kppid) != 0) {
+    return 1;
+  }
+  return (stat == PROC_WAITABLE) || (stat == PROC_ZOMBIED);
+}
+
 /**
  * Wait on a kernel process by id
  * @param  kpid    the process id
@@ -42,30 +59,30 @@ int kwaitpid(uint64_t kpid,
              uint8_t options) {
   *status = 0;
 
-  kpcb_t* pcb;
-  if (get_proc_kpid(kpid,&pcb) == 0) {
-
-    //check if child exited, not yet waited on
-    if (pcb->stat == PROC_WAITABLE) {
-      *status = *status | STATUS_WEXITED;
-      *status = *status | (uint16_t) pcb->exit_code;
-      //free the process
-      free_kproc(pcb);
-      return kpid;
-
-    } else if (pcb->stat == PROC_RUNNING) {
-      //block on this process
-      if (!(options & WNOHANG)) {
-        //block this process
-        set_curr_proc_state(PROC_WAITING);
+  kproc_stat stat;
+  uint64_t kppid;
+  if (kpid_stat(kpid,&stat,&kppid) != 0) {
+    //process with kpid not found
+    return -1;
+  }
 
-        //process woke from signal, try to wait on kpid again
-        return kwaitpid(kpid,status,options);
-      }
-    }
+  //exits are announced on the parent's queue
+  kpcb_t* parent;
+  if (!(options & WNOHANG) && (get_proc_kpid(kppid,&parent) == 0)) {
+    wait_event(&parent->child_exit,kproc_exited(kpid));
+  }
 
-  } else {
-    //process with kpid not found
+  //every waiter is woken, only the one that claims the child frees it
+  kpcb_t* pcb;
+  uint8_t claim = kpid_claim_exited(kpid,&pcb);
+  if (claim == 0) {
+    *status = *status | STATUS_WEXITED;
+    *status = *status | (uint16_t) pcb->exit_code;
+    //free the process (its id is already released)
+    free_kproc(pcb);
+    return kpid;
+  } else if (claim == 1) {
+    //reaped by another waiter or not waitable
     return -1;
   }
 
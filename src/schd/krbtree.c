@@ -0,0 +1,310 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "krbtree.h"
+
+/**
+ * Replace the link to a node from its parent (or the root)
+ * @param root the tree
+ * @param old  the node being replaced
+ * @param new  the replacement (may be NULL)
+ */
+static void krb_replace(krb_root_t* root, krb_node_t* old, krb_node_t* new) {
+  krb_node_t* parent = old->parent;
+  if (parent == NULL) {
+    root->root = new;
+  } else if (parent->left == old) {
+    parent->left = new;
+  } else {
+    parent->right = new;
+  }
+  if (new != NULL) {
+    new->parent = parent;
+  }
+}
+
+/**
+ * Rotate a node down to the left
+ * @param root the tree
+ * @param node the node (has a right child)
+ */
+static void krb_rotate_left(krb_root_t* root, krb_node_t* node) {
+  krb_node_t* right = node->right;
+  node->right = right->left;
+  if (right->left != NULL) {
+    right->left->parent = node;
+  }
+  krb_replace(root,node,right);
+  right->left = node;
+  node->parent = right;
+}
+
+/**
+ * Rotate a node down to the right
+ * @param root the tree
+ * @param node the node (has a left child)
+ */
+static void krb_rotate_right(krb_root_t* root, krb_node_t* node) {
+  krb_node_t* left = node->left;
+  node->left = left->right;
+  if (left->right != NULL) {
+    left->right->parent = node;
+  }
+  krb_replace(root,node,left);
+  left->right = node;
+  node->parent = left;
+}
+
+static inline uint8_t krb_is_red(krb_node_t* node) {
+  return (node != NULL) && node->red;
+}
+
+/**
+ * Insert a node, O(log n)
+ * Equal keys are kept in insertion order
+ * @param root the tree
+ * @param node the node to insert
+ * @param less whether a sorts before b
+ */
+void krb_insert(krb_root_t* root,
+                krb_node_t* node,
+                uint8_t (*less)(krb_node_t* a, krb_node_t* b)) {
+  krb_node_t* parent = NULL;
+  krb_node_t** link = &root->root;
+  uint8_t leftmost = 1;
+
+  while (*link != NULL) {
+    parent = *link;
+    if (less(node,parent)) {
+      link = &parent->left;
+    } else {
+      link = &parent->right;
+      leftmost = 0;
+    }
+  }
+
+  node->parent = parent;
+  node->left = NULL;
+  node->right = NULL;
+  node->red = 1;
+  *link = node;
+  if (leftmost) {
+    root->leftmost = node;
+  }
+
+  //restore the red-black properties
+  while (krb_is_red(node->parent)) {
+    parent = node->parent;
+    krb_node_t* gparent = parent->parent;
+
+    if (parent == gparent->left) {
+      krb_node_t* uncle = gparent->right;
+      if (krb_is_red(uncle)) {
+        parent->red = 0;
+        uncle->red = 0;
+        gparent->red = 1;
+        node = gparent;
+        continue;
+      }
+      if (node == parent->right) {
+        krb_rotate_left(root,parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->red = 0;
+      gparent->red = 1;
+      krb_rotate_right(root,gparent);
+    } else {
+      krb_node_t* uncle = gparent->left;
+      if (krb_is_red(uncle)) {
+        parent->red = 0;
+        uncle->red = 0;
+        gparent->red = 1;
+        node = gparent;
+        continue;
+      }
+      if (node == parent->left) {
+        krb_rotate_right(root,parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->red = 0;
+      gparent->red = 1;
+      krb_rotate_left(root,gparent);
+    }
+  }
+  root->root->red = 0;
+}
+
+/**
+ * Remove a node, O(log n)
+ * @param root the tree
+ * @param node a node in the tree
+ */
+void krb_erase(krb_root_t* root, krb_node_t* node) {
+  if (root->leftmost == node) {
+    root->leftmost = krb_next(node);
+  }
+
+  //child: the node that moves into the removed position
+  //parent: its parent after the removal
+  krb_node_t* child;
+  krb_node_t* parent;
+  uint8_t removed_red;
+
+  if (node->left == NULL) {
+    child = node->right;
+    parent = node->parent;
+    removed_red = node->red;
+    krb_replace(root,node,child);
+  } else if (node->right == NULL) {
+    child = node->left;
+    parent = node->parent;
+    removed_red = node->red;
+    krb_replace(root,node,child);
+  } else {
+    //swap in the successor, which has no left child
+    krb_node_t* succ = node->right;
+    while (succ->left != NULL) {
+      succ = succ->left;
+    }
+    removed_red = succ->red;
+    child = succ->right;
+
+    if (succ->parent == node) {
+      parent = succ;
+    } else {
+      parent = succ->parent;
+      krb_replace(root,succ,child);
+      succ->right = node->right;
+      succ->right->parent = succ;
+    }
+    krb_replace(root,node,succ);
+    succ->left = node->left;
+    succ->left->parent = succ;
+    succ->red = node->red;
+  }
+
+  if (removed_red) {
+    return;
+  }
+
+  //a black node was removed, rebalance from child
+  while ((child != root->root) && !krb_is_red(child)) {
+    if (child == parent->left) {
+      krb_node_t* sib = parent->right;
+      if (krb_is_red(sib)) {
+        sib->red = 0;
+        parent->red = 1;
+        krb_rotate_left(root,parent);
+        sib = parent->right;
+      }
+      if (!krb_is_red(sib->left) && !krb_is_red(sib->right)) {
+        sib->red = 1;
+        child = parent;
+        parent = child->parent;
+        continue;
+      }
+      if (!krb_is_red(sib->right)) {
+        sib->left->red = 0;
+        sib->red = 1;
+        krb_rotate_right(root,sib);
+        sib = parent->right;
+      }
+      sib->red = parent->red;
+      parent->red = 0;
+      sib->right->red = 0;
+      krb_rotate_left(root,parent);
+      child = root->root;
+    } else {
+      krb_node_t* sib = parent->left;
+      if (krb_is_red(sib)) {
+        sib->red = 0;
+        parent->red = 1;
+        krb_rotate_right(root,parent);
+        sib = parent->left;
+      }
+      if (!krb_is_red(sib->left) && !krb_is_red(sib->right)) {
+        sib->red = 1;
+        child = parent;
+        parent = child->parent;
+        continue;
+      }
+      if (!krb_is_red(sib->left)) {
+        sib->right->red = 0;
+        sib->red = 1;
+        krb_rotate_left(root,sib);
+        sib = parent->left;
+      }
+      sib->red = parent->red;
+      parent->red = 0;
+      sib->left->red = 0;
+      krb_rotate_right(root,parent);
+      child = root->root;
+    }
+  }
+  if (child != NULL) {
+    child->red = 0;
+  }
+}
+
+/**
+ * Get the smallest node, O(1)
+ * @param  root the tree
+ * @return      the node, NULL if empty
+ */
+krb_node_t* krb_first(krb_root_t* root) {
+  return root->leftmost;
+}
+
+/**
+ * Get the largest node
+ * @param  root the tree
+ * @return      the node, NULL if empty
+ */
+krb_node_t* krb_last(krb_root_t* root) {
+  krb_node_t* node = root->root;
+  while ((node != NULL) && (node->right != NULL)) {
+    node = node->right;
+  }
+  return node;
+}
+
+/**
+ * Get the next smaller node
+ * @param  node a node in a tree
+ * @return      the node, NULL if node is the smallest
+ */
+krb_node_t* krb_prev(krb_node_t* node) {
+  if (node->left != NULL) {
+    node = node->left;
+    while (node->right != NULL) {
+      node = node->right;
+    }
+    return node;
+  }
+  while ((node->parent != NULL) && (node == node->parent->left)) {
+    node = node->parent;
+  }
+  return node->parent;
+}
+
+/**
+ * Get the next larger node
+ * @param  node a node in a tree
+ * @return      the node, NULL if node is the largest
+ */
+krb_node_t* krb_next(krb_node_t* node) {
+  if (node->right != NULL) {
+    node = node->right;
+    while (node->left != NULL) {
+      node = node->left;
+    }
+    return node;
+  }
+  while ((node->parent != NULL) && (node == node->parent->right)) {
+    node = node->parent;
+  }
+  return node->parent;
+}
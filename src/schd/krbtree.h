@@ -0,0 +1,79 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _SCHD_KRBTREE_H
+#define _SCHD_KRBTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Red-black tree node, embedded in the structure it orders
+ */
+typedef struct krb_node_t {
+  struct krb_node_t* parent;
+  struct krb_node_t* left;
+  struct krb_node_t* right;
+  uint8_t red;
+} krb_node_t;
+
+/*
+ * Red-black tree with the leftmost (smallest) node cached
+ */
+typedef struct krb_root_t {
+  krb_node_t* root;
+  krb_node_t* leftmost;
+} krb_root_t;
+
+//the structure containing a node
+#define krb_entry(node, type, member) \
+  ((type*) ((uint8_t*) (node) - offsetof(type, member)))
+
+/**
+ * Insert a node, O(log n)
+ * Equal keys are kept in insertion order
+ * @param root the tree
+ * @param node the node to insert
+ * @param less whether a sorts before b
+ */
+void krb_insert(krb_root_t* root,
+                krb_node_t* node,
+                uint8_t (*less)(krb_node_t* a, krb_node_t* b));
+
+/**
+ * Remove a node, O(log n)
+ * @param root the tree
+ * @param node a node in the tree
+ */
+void krb_erase(krb_root_t* root, krb_node_t* node);
+
+/**
+ * Get the smallest node, O(1)
+ * @param  root the tree
+ * @return      the node, NULL if empty
+ */
+krb_node_t* krb_first(krb_root_t* root);
+
+/**
+ * Get the largest node
+ * @param  root the tree
+ * @return      the node, NULL if empty
+ */
+krb_node_t* krb_last(krb_root_t* root);
+
+/**
+ * Get the next smaller node
+ * @param  node a node in a tree
+ * @return      the node, NULL if node is the smallest
+ */
+krb_node_t* krb_prev(krb_node_t* node);
+
+/**
+ * Get the next larger node
+ * @param  node a node in a tree
+ * @return      the node, NULL if node is the largest
+ */
+krb_node_t* krb_next(krb_node_t* node);
+
+#endif /*_SCHD_KRBTREE_H*/
@@ -3,14 +3,21 @@
  */
 
 #include "kschd.h"
+#include "kpid.h"
 #include "../kstdlib/kstdlib.h"
 #include "../mmu/kheap.h"
 #include "../mmu/mmu.h"
+#include "../mmu/kslab.h"
 #include "../uart/debug.h"
+#include "../irq/irq.h"
+#include "../timer/timer.h"
+#include "../smp/smp.h"
+#include "../smp/spinlock.h"
 
 #define PRIORITY_HIGH 0
 #define PRIORITY_MED  1
 #define PRIORITY_LOW  2
+#define PRIORITY_LEVELS KSCHD_LEVELS
 
 #define FLAG_EXITED     0x80
 #define FLAG_TERMINATED 0x40
@@ -22,144 +29,952 @@ void cpu_context_switch(kproc_state_t* prev,
 //sets args, calls run_kproc
 void call_proc();
 
-//kernel threads by priority
-kpcb_t* KTHREADS_PRI0 = NULL; //highest
-kpcb_t* KTHREADS_PRI1 = NULL;
-kpcb_t* KTHREADS_PRI2 = NULL; //lowest
+#ifndef KSCHD_CFS
+/*
+ * Runnable threads at one priority level (FIFO)
+ */
+typedef struct krunq_t {
+  kpcb_t* head;
+  kpcb_t* tail;
+} krunq_t;
+#endif
 
-//last process id assigned
-uint64_t LAST_KPID = 0;
+/*
+ * Scheduler state of one core, reached through TPIDR_EL1
+ */
+typedef struct kcpu_t {
+  //the running process
+  kpcb_t* curr;
+  //the process switched away from, until the switch completes
+  kpcb_t* prev;
+  //runs when nothing else can (never queued)
+  kpcb_t* idle;
+  //processes in kthread_sleep_ms on this core, soonest first
+  kpcb_t* sleepers;
+#ifdef KSCHD_CFS
+  //runnable kernel threads by vruntime, the leftmost is cached
+  krb_root_t runq_tree;
+  //the sum of the weights on runq_tree
+  uint64_t load_weight;
+  //never decreases, woken and migrated processes are placed near it
+  uint64_t min_vruntime;
+#else
+  //runnable kernel threads by priority (0 highest)
+  krunq_t runq[PRIORITY_LEVELS];
+  //non empty run queues, priority p is bit (31 - p) so clz finds the highest
+  uint32_t runq_map;
+#endif
+  //processes on the run queues
+  uint32_t nr_queued;
+  //whether this core is scheduling
+  uint8_t online;
+  //prev is moved to another core once the switch completes (affinity)
+  uint8_t prev_migrate;
+  //the idle process is in wfi, work queued here needs a wakeup
+  uint8_t sleeping;
+  //the run queues and the state of processes on this core
+  kspinlock_t lock;
 
-//the current running process
-kpcb_t* CURRENT_PROC = NULL;
+  //context switches
+  uint64_t switches;
+  //processes this core took from a busier core's queue
+  uint64_t steals;
+  //processes taken from this core's queue by other cores
+  uint64_t stolen;
+  //processes moved onto this core from another core
+  uint64_t migrations;
+  //timer interrupts taken
+  uint64_t ticks;
+  //counter ticks spent in wfi
+  uint64_t idle_time;
+} kcpu_t;
+
+kcpu_t KCPUS[SMP_CORES];
+
+/**
+ * Get the scheduler state of the calling core
+ * @return the core's state
+ */
+static inline kcpu_t* this_kcpu() {
+  kcpu_t* cpu;
+  asm volatile("mrs %0, tpidr_el1" : "=r"(cpu));
+  return cpu;
+}
+
+//the process running on this core
+#define CURRENT_PROC (this_kcpu()->curr)
+
+//object caches for process control blocks and state
+kmem_cache_t* KPCB_CACHE = NULL;
+kmem_cache_t* KSTATE_CACHE = NULL;
 
 /**
  * Enable preemption on this process
  */
 void ENABLE_PREEMPT() {
+  //the core and its current process are read together
+  uint64_t flags = irq_save();
   if (CURRENT_PROC != NULL) {
     CURRENT_PROC->state->preempt_counter--;
   }
+  irq_restore(flags);
 }
 
 void DISABLE_PREEMPT() {
+  uint64_t flags = irq_save();
   if (CURRENT_PROC != NULL) {
     CURRENT_PROC->state->preempt_counter++;
   }
+  irq_restore(flags);
 }
 
+void kschd_schedule();
+static uint8_t kschd_steal();
+
+/*
+ * Weight of each niceness (-20 to 19), each step is ~10% of cpu
+ * time relative to a process one step away
+ */
+static const uint32_t KSCHD_NICE_WEIGHTS[40] = {
+  /* -20 */ 88761, 71755, 56483, 46273, 36291,
+  /* -15 */ 29154, 23254, 18705, 14949, 11916,
+  /* -10 */ 9548, 7620, 6100, 4904, 3906,
+  /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+  /*   0 */ 1024, 820, 655, 526, 423,
+  /*   5 */ 335, 272, 215, 172, 137,
+  /*  10 */ 110, 87, 70, 56, 45,
+  /*  15 */ 36, 29, 23, 18, 15
+};
+
+//the weight of nice 0, vruntime advances at wall clock rate
+#define KSCHD_NICE_0_WEIGHT 1024
+
+/*
+ * Scheduling parameters (kschd_set_tunables)
+ */
+kschd_tunables_t KSCHD_TUNE = {
+  //high, medium, low slices
+  {10, 20, 40},
+  //boost_after, decay_after
+  2, 4,
+  //period_ms, min_slice_ms
+  20, 4
+};
+
 /**
- * Idle process
+ * Convert a slice length to timer ticks
+ * @param  ms the length in milliseconds
+ * @return    the ticks, at least 1
  */
-void idle_debug() {
-  debug_err("reached idle debug");
-  while (1) {}
+static inline int ms_to_ticks(uint32_t ms) {
+  uint64_t ticks = ((uint64_t) ms * KTIMER_HZ) / 1000;
+  return (ticks > 0) ? ticks : 1;
 }
 
 /**
- * Dequeue a process that can be run
- * @return the process to run
+ * Record how a process's slice ended, called as it is switched
+ * away from (core lock held)
+ * Only the priority policy queues by interactivity
+ * @param pcb the process
  */
-kpcb_t* dequeue_kproc() {
-  //try at each priority level
-  for (int p=0; p<3; p++) {
-    //check highest pri processes
-    kpcb_t** curr_queue;
-
-    if (p == 0) {
-      curr_queue = &KTHREADS_PRI0;
-    } else if (p == 1) {
-      curr_queue = &KTHREADS_PRI1;
-    } else {
-      curr_queue = &KTHREADS_PRI2;
+static void kschd_slice_end(kpcb_t* pcb) {
+  if (pcb->state->tick_count > 0) {
+    //blocked or yielded with time left
+    if (pcb->interactivity < KSCHD_INTERACTIVITY_MAX) {
+      pcb->interactivity++;
     }
+  } else if (pcb->interactivity > -KSCHD_INTERACTIVITY_MAX) {
+    pcb->interactivity--;
+  }
+}
 
-    while (*curr_queue != NULL) {
-      //check for the first running process
-      if ((*curr_queue)->stat == PROC_RUNNING) {
-        //the process to dequeue
-        kpcb_t *proc = *curr_queue;
+/**
+ * Check whether a process may run on a core
+ * @param  pcb  the process
+ * @param  core the core id
+ * @return      1 if allowed
+ */
+static inline uint8_t kschd_allowed(kpcb_t* pcb, uint8_t core) {
+  return (pcb->affinity >> core) & 1;
+}
 
-        //remove this process from the list
-        if ((*curr_queue)->prev != NULL) {
-          (*curr_queue)->prev->next = (*curr_queue)->next;
-        }
-        *curr_queue = (*curr_queue)->next;
+#ifdef KSCHD_CFS
 
-        return proc;
-      }
+//the period in system counter ticks (set with the tunables)
+uint64_t KSCHD_PERIOD_COUNT = 0;
+
+/**
+ * Order processes by vruntime, ties keep insertion order
+ */
+static uint8_t vruntime_less(krb_node_t* a, krb_node_t* b) {
+  return krb_entry(a,kpcb_t,rb_node)->vruntime <
+         krb_entry(b,kpcb_t,rb_node)->vruntime;
+}
 
-      //get the next proc in this queue
-      curr_queue = &((*curr_queue)->next);
+/**
+ * Advance the core's min_vruntime to the lowest vruntime that
+ * can still run there (core lock held)
+ * @param cpu the core
+ */
+static void update_min_vruntime(kcpu_t* cpu) {
+  kpcb_t* curr = cpu->curr;
+  uint8_t found = 0;
+  uint64_t vmin = 0;
+  if ((curr != NULL) && (curr != cpu->idle) && (curr->stat == PROC_RUNNING)) {
+    vmin = curr->vruntime;
+    found = 1;
+  }
+  krb_node_t* left = krb_first(&cpu->runq_tree);
+  if (left != NULL) {
+    uint64_t v = krb_entry(left,kpcb_t,rb_node)->vruntime;
+    if (!found || (v < vmin)) {
+      vmin = v;
     }
+    found = 1;
+  }
+  if (found && (vmin > cpu->min_vruntime)) {
+    cpu->min_vruntime = vmin;
+  }
+}
+
+/**
+ * Charge the running process for the time since it was last charged
+ * (core lock held)
+ * @param cpu the core
+ */
+static void update_curr(kcpu_t* cpu) {
+  kpcb_t* curr = cpu->curr;
+  uint64_t now = get_sys_count();
+  uint64_t delta = now - curr->exec_start;
+  curr->exec_start = now;
+  if (curr == cpu->idle) {
+    return;
   }
+  curr->vruntime += (delta * KSCHD_NICE_0_WEIGHT) / curr->weight;
+  update_min_vruntime(cpu);
+}
+
+/**
+ * Take a queued process off its run queue (core lock held)
+ * @param cpu the core
+ * @param pcb the process, on this core's queue
+ */
+static void runq_remove(kcpu_t* cpu, kpcb_t* pcb) {
+  krb_erase(&cpu->runq_tree,&pcb->rb_node);
+  cpu->load_weight -= pcb->weight;
+  cpu->nr_queued--;
+  pcb->on_rq = 0;
+}
 
-  //unable to find a candidate
-  return CURRENT_PROC;
+/**
+ * Dequeue the process with the lowest vruntime, O(1) to find
+ * (core lock held)
+ * @param  cpu the core
+ * @return     the process to run, NULL if none are runnable
+ */
+kpcb_t* dequeue_kproc(kcpu_t* cpu) {
+  krb_node_t* node = krb_first(&cpu->runq_tree);
+  if (node == NULL) {
+    return NULL;
+  }
+  kpcb_t* proc = krb_entry(node,kpcb_t,rb_node);
+  runq_remove(cpu,proc);
+  return proc;
 }
 
 /**
- * Add a process to the runnable queue
+ * Add a process to the run queue by vruntime, O(log n)
+ * Only runnable processes are queued (core lock held)
+ * @param cpu   the core
  * @param pcb   the process control block
  */
-void enqueue_kproc(kpcb_t* pcb) {
-  kpcb_t** queue;
+void enqueue_kproc(kcpu_t* cpu, kpcb_t* pcb) {
+  //a new or long blocked process is credited at most half a
+  //period so it runs soon without starving the others
+  uint64_t credit = KSCHD_PERIOD_COUNT / 2;
+  uint64_t floor = (cpu->min_vruntime > credit) ?
+                    cpu->min_vruntime - credit : 0;
+  if (pcb->vruntime < floor) {
+    pcb->vruntime = floor;
+  }
+
+  krb_insert(&cpu->runq_tree,&pcb->rb_node,vruntime_less);
+  cpu->load_weight += pcb->weight;
+  cpu->nr_queued++;
+  pcb->on_rq = 1;
+}
 
-  //determine the queue to add to based on priority
-  if (pcb->priority == PRIORITY_HIGH) {
-    queue = &KTHREADS_PRI0;
-  } else if (pcb->priority == PRIORITY_MED) {
-    queue = &KTHREADS_PRI1;
+/**
+ * Keep a process's lead or lag on its old core when it moves
+ * (min_vruntime on the old core may be read without its lock)
+ * @param from the old core
+ * @param to   the new core
+ * @param pcb  the process, on no run queue
+ */
+static void runq_migrate(kcpu_t* from, kcpu_t* to, kpcb_t* pcb) {
+  int64_t lag = pcb->vruntime - from->min_vruntime;
+  if ((lag < 0) && ((uint64_t) -lag > to->min_vruntime)) {
+    pcb->vruntime = 0;
   } else {
-    queue = &KTHREADS_PRI2;
+    pcb->vruntime = to->min_vruntime + lag;
   }
+}
 
-  //added to end of queue
+/**
+ * Find a queued process another core may take (victim lock held)
+ * @param  victim the core to take from
+ * @param  core   the core taking it
+ * @return        the process, NULL if none can move
+ */
+static kpcb_t* runq_steal_pick(kcpu_t* victim, uint8_t core) {
+  //highest vruntime first: it would wait longest on the victim
+  for (krb_node_t* node = krb_last(&victim->runq_tree);
+       node != NULL; node = krb_prev(node)) {
+    kpcb_t* pcb = krb_entry(node,kpcb_t,rb_node);
+    if (kschd_allowed(pcb,core) && !pcb->on_cpu) {
+      return pcb;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Get the ticks a process runs for before the next is picked
+ * The period is shared by weight with the processes queued behind it
+ * @param  cpu  the core (lock held)
+ * @param  next the process about to run
+ * @return      the slice in timer ticks
+ */
+static int runq_slice(kcpu_t* cpu, kpcb_t* next) {
+  uint64_t period = ms_to_ticks(KSCHD_TUNE.period_ms);
+  uint64_t min = ms_to_ticks(KSCHD_TUNE.min_slice_ms);
+  uint64_t slice = (period * next->weight) / (cpu->load_weight + next->weight);
+  return (slice > min) ? slice : min;
+}
+
+#else
+
+/**
+ * Charge the running process for the time since it was last charged
+ * (core lock held)
+ * @param cpu the core
+ */
+static void update_curr(kcpu_t* cpu) {
+  cpu->curr->exec_start = get_sys_count();
+}
+
+/**
+ * Get the level a process is queued at: its priority, one higher
+ * once it keeps ending slices early and one lower once it keeps
+ * using them up
+ * @param  pcb the process
+ * @return     the level (0 highest)
+ */
+static uint8_t kschd_run_priority(kpcb_t* pcb) {
+  uint8_t p = pcb->priority;
+  if (p >= PRIORITY_LEVELS) {
+    p = PRIORITY_LOW;
+  }
+  int32_t boost = KSCHD_TUNE.boost_after;
+  int32_t decay = KSCHD_TUNE.decay_after;
+  if ((boost > 0) && (pcb->interactivity >= boost) && (p > PRIORITY_HIGH)) {
+    p--;
+  } else if ((decay > 0) && (pcb->interactivity <= -decay) && (p < PRIORITY_LOW)) {
+    p++;
+  }
+  return p;
+}
+
+/**
+ * Dequeue the highest priority runnable process (core lock held)
+ * @param  cpu the core
+ * @return     the process to run, NULL if none are runnable
+ */
+kpcb_t* dequeue_kproc(kcpu_t* cpu) {
+  if (cpu->runq_map == 0) {
+    return NULL;
+  }
+
+  uint8_t p = __builtin_clz(cpu->runq_map);
+  krunq_t* queue = &cpu->runq[p];
+
+  kpcb_t* proc = queue->head;
+  queue->head = proc->next;
+  if (queue->head == NULL) {
+    queue->tail = NULL;
+    cpu->runq_map &= ~(1U << (31 - p));
+  } else {
+    queue->head->prev = NULL;
+  }
+  cpu->nr_queued--;
+
+  proc->on_rq = 0;
+  proc->next = NULL;
+  proc->prev = NULL;
+  return proc;
+}
+
+/**
+ * Take a queued process off its run queue (core lock held)
+ * @param cpu the core
+ * @param pcb the process, on this core's queue
+ */
+static void runq_remove(kcpu_t* cpu, kpcb_t* pcb) {
+  uint8_t p = pcb->run_priority;
+  krunq_t* queue = &cpu->runq[p];
+
+  if (pcb->prev != NULL) {
+    pcb->prev->next = pcb->next;
+  } else {
+    queue->head = pcb->next;
+  }
+  if (pcb->next != NULL) {
+    pcb->next->prev = pcb->prev;
+  } else {
+    queue->tail = pcb->prev;
+  }
+  if (queue->head == NULL) {
+    cpu->runq_map &= ~(1U << (31 - p));
+  }
+  cpu->nr_queued--;
+
+  pcb->on_rq = 0;
   pcb->next = NULL;
+  pcb->prev = NULL;
+}
 
-  if (*queue == NULL) {
-    *queue = pcb;
+/**
+ * Add a process to the tail of the runnable queue for its run priority
+ * Only runnable processes are queued (core lock held)
+ * @param cpu   the core
+ * @param pcb   the process control block
+ */
+void enqueue_kproc(kcpu_t* cpu, kpcb_t* pcb) {
+  uint8_t p = kschd_run_priority(pcb);
+  pcb->run_priority = p;
+  krunq_t* queue = &cpu->runq[p];
+
+  pcb->next = NULL;
+  pcb->prev = queue->tail;
+  if (queue->tail == NULL) {
+    queue->head = pcb;
   } else {
-    kpcb_t* curr = *queue;
-    while (curr->next != NULL) {
-      curr = curr->next;
+    queue->tail->next = pcb;
+  }
+  queue->tail = pcb;
+  cpu->runq_map |= 1U << (31 - p);
+  cpu->nr_queued++;
+  pcb->on_rq = 1;
+}
+
+
+/**
+ * Keep a process's lead or lag on its old core when it moves
+ * (priority queues carry no per core state)
+ */
+static void runq_migrate(kcpu_t* from, kcpu_t* to, kpcb_t* pcb) {
+  (void) from;
+  (void) to;
+  (void) pcb;
+}
+
+/**
+ * Find a queued process another core may take (victim lock held)
+ * @param  victim the core to take from
+ * @param  core   the core taking it
+ * @return        the process, NULL if none can move
+ */
+static kpcb_t* runq_steal_pick(kcpu_t* victim, uint8_t core) {
+  //highest priority first, oldest last: the tail of each queue
+  //has the least cache state left on the victim
+  uint32_t map = victim->runq_map;
+  while (map) {
+    uint8_t p = __builtin_clz(map);
+    map &= ~(1U << (31 - p));
+    for (kpcb_t* pcb = victim->runq[p].tail; pcb != NULL; pcb = pcb->prev) {
+      if (kschd_allowed(pcb,core) && !pcb->on_cpu) {
+        return pcb;
+      }
     }
-    //add to linked list
-    pcb->prev = curr;
-    curr->next = pcb;
   }
+  return NULL;
 }
 
 /**
- * Schedule a new process
+ * Get the ticks a process runs for before the next is picked
+ * Lower levels run longer so hogs switch less often
+ * @param  cpu  the core (lock held)
+ * @param  next the process about to run
+ * @return      the slice in timer ticks
  */
-void kschd_schedule() {
-  //swap the process currently being run,
-  //enqueue the process that is relinquishing cpu
-  kpcb_t *curr = CURRENT_PROC;
-  CURRENT_PROC = dequeue_kproc();
-  enqueue_kproc(curr);
+static int runq_slice(kcpu_t* cpu, kpcb_t* next) {
+  (void) cpu;
+  return ms_to_ticks(KSCHD_TUNE.slice_ms[next->run_priority]);
+}
+
+#endif
+
+/**
+ * Find the online core with the least runnable work
+ * Read without the core locks, the result is only a placement hint
+ * @param  pcb the process to place (its affinity is respected)
+ * @return     the core, the boot core if none are allowed
+ */
+static kcpu_t* kschd_pick_core(kpcb_t* pcb) {
+  kcpu_t* best = NULL;
+  uint32_t best_load = 0;
+  for (uint8_t c=0; c<SMP_CORES; c++) {
+    kcpu_t* cpu = &KCPUS[c];
+    if (!cpu->online || !kschd_allowed(pcb,c)) {
+      continue;
+    }
+    uint32_t load = cpu->nr_queued;
+    if ((cpu->curr != NULL) && (cpu->curr != cpu->idle)) {
+      load++;
+    }
+    if ((best == NULL) || (load < best_load)) {
+      best = cpu;
+      best_load = load;
+    }
+  }
+  return (best != NULL) ? best : &KCPUS[0];
+}
+
+/**
+ * Make sure a process just queued on a core is picked up soon
+ * A core asleep in wfi is woken, a busy core's queue is offered
+ * to a sleeping core that may take the process (no core lock held)
+ * @param cpu the core the process was queued on
+ * @param pcb the process
+ */
+static void kschd_kick(kcpu_t* cpu, kpcb_t* pcb) {
+  //pairs with the fence in kschd_idle_wait: either the sleeper
+  //sees the queued process or this sees it sleeping
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cpu->sleeping,__ATOMIC_RELAXED)) {
+    irq_send_wakeup(cpu - KCPUS);
+    return;
+  }
+  if (cpu->curr == cpu->idle) {
+    //the idle process is polling and picks it up
+    return;
+  }
+  for (uint8_t c=0; c<SMP_CORES; c++) {
+    kcpu_t* other = &KCPUS[c];
+    if ((other != cpu) && other->online && kschd_allowed(pcb,c) &&
+        __atomic_load_n(&other->sleeping,__ATOMIC_RELAXED)) {
+      irq_send_wakeup(c);
+      return;
+    }
+  }
+}
+
+/**
+ * Queue a runnable process that is on no run queue on
+ * the least loaded core it may run on (no core lock held)
+ * @param pcb the process
+ */
+static void kschd_place(kpcb_t* pcb) {
+  kcpu_t* cpu = kschd_pick_core(pcb);
+  uint8_t core = cpu - KCPUS;
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  if (pcb->cpu != core) {
+    runq_migrate(&KCPUS[pcb->cpu],cpu,pcb);
+    cpu->migrations++;
+  }
+  pcb->cpu = core;
+  enqueue_kproc(cpu,pcb);
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+  kschd_kick(cpu,pcb);
+}
+
+/**
+ * Lock two cores, lowest first so cores locking each other cannot deadlock
+ * @param  a a core
+ * @param  b another core
+ * @return   the irq state to restore
+ */
+static uint64_t kschd_lock_pair(kcpu_t* a, kcpu_t* b) {
+  uint64_t flags = irq_save();
+  if (a < b) {
+    kspin_lock(&a->lock);
+    kspin_lock(&b->lock);
+  } else {
+    kspin_lock(&b->lock);
+    kspin_lock(&a->lock);
+  }
+  return flags;
+}
+
+/**
+ * Unlock two cores locked by kschd_lock_pair()
+ * @param a     a core
+ * @param b     another core
+ * @param flags the irq state to restore
+ */
+static void kschd_unlock_pair(kcpu_t* a, kcpu_t* b, uint64_t flags) {
+  kspin_unlock(&a->lock);
+  kspin_unlock(&b->lock);
+  irq_restore(flags);
+}
+
+/**
+ * Lock the core a process belongs to
+ * The core is checked again once locked, a stealing core
+ * may have moved the process in between
+ * @param  pcb   the process
+ * @param  flags the irq state to restore (set)
+ * @return       the locked core, pcb->cpu is stable until unlocked
+ */
+static kcpu_t* kschd_lock_task(kpcb_t* pcb, uint64_t* flags) {
+  while (1) {
+    uint8_t core = __atomic_load_n(&pcb->cpu,__ATOMIC_RELAXED);
+    kcpu_t* cpu = &KCPUS[core];
+    *flags = kspin_lock_irqsave(&cpu->lock);
+    if (pcb->cpu == core) {
+      return cpu;
+    }
+    kspin_unlock_irqrestore(&cpu->lock,*flags);
+  }
+}
+
+/**
+ * Take a sleeping process off its core's sleep list (core lock held)
+ * @param cpu the core
+ * @param pcb the process, sleeping on this core
+ */
+static void sleep_remove(kcpu_t* cpu, kpcb_t* pcb) {
+  kpcb_t** link = &cpu->sleepers;
+  while ((*link != NULL) && (*link != pcb)) {
+    link = &(*link)->sleep_next;
+  }
+  if (*link != NULL) {
+    *link = pcb->sleep_next;
+  }
+  pcb->sleep_next = NULL;
+  pcb->wake_at = 0;
+}
+
+/**
+ * Make sleeping processes whose time is up runnable
+ * (called on their core from the timer irq)
+ * @param cpu this core
+ */
+static void kschd_wake_sleepers(kcpu_t* cpu) {
+  //processes no longer allowed on this core, placed once unlocked
+  kpcb_t* place = NULL;
+  kpcb_t* queued = NULL;
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  uint64_t now = get_sys_count();
+  while ((cpu->sleepers != NULL) && (cpu->sleepers->wake_at <= now)) {
+    kpcb_t* pcb = cpu->sleepers;
+    cpu->sleepers = pcb->sleep_next;
+    pcb->sleep_next = NULL;
+    pcb->wake_at = 0;
+    pcb->stat = PROC_RUNNING;
+    if (kschd_allowed(pcb,cpu - KCPUS)) {
+      enqueue_kproc(cpu,pcb);
+      queued = pcb;
+    } else {
+      pcb->sleep_next = place;
+      place = pcb;
+    }
+  }
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+
+  if (queued != NULL) {
+    kschd_kick(cpu,queued);
+  }
+  while (place != NULL) {
+    kpcb_t* pcb = place;
+    place = pcb->sleep_next;
+    pcb->sleep_next = NULL;
+    kschd_place(pcb);
+  }
+}
+
+/**
+ * Make a blocked process runnable again on its core
+ * A process that has not blocked yet keeps the wakeup
+ * and does not block on its next wait
+ * @param pcb the process control block
+ */
+void kschd_wake(kpcb_t* pcb) {
+  uint8_t place = 0;
+  uint8_t queued = 0;
+  uint64_t flags;
+  kcpu_t* cpu = kschd_lock_task(pcb,&flags);
+  if (pcb->stat == PROC_WAITING) {
+    if (pcb->wake_at) {
+      //cut a sleep short
+      sleep_remove(cpu,pcb);
+    }
+    pcb->stat = PROC_RUNNING;
+    if (kschd_allowed(pcb,pcb->cpu)) {
+      enqueue_kproc(cpu,pcb);
+      queued = 1;
+    } else {
+      //affinity changed while it was blocked
+      place = 1;
+    }
+  } else if (pcb->stat == PROC_RUNNING) {
+    pcb->wake_pending = 1;
+  }
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+
+  if (queued) {
+    kschd_kick(cpu,pcb);
+  } else if (place) {
+    kschd_place(pcb);
+  }
+}
+
+/**
+ * Drop a wakeup the current process received without blocking
+ * (its wait condition was already true)
+ */
+void kschd_clear_wake() {
+  DISABLE_PREEMPT();
+  kcpu_t* cpu = this_kcpu();
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  cpu->curr->wake_pending = 0;
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+  ENABLE_PREEMPT();
+}
+
+/**
+ * Complete a context switch on the process switched to
+ * The previous process's stack and state are free to be reused
+ */
+static void kschd_finish_switch() {
+  kcpu_t* cpu = this_kcpu();
+  kpcb_t* prev = cpu->prev;
+  if (prev == NULL) {
+    return;
+  }
+  cpu->prev = NULL;
+  __atomic_store_n(&prev->on_cpu,0,__ATOMIC_RELEASE);
+
+  if (cpu->prev_migrate) {
+    //runnable but no longer allowed on this core
+    cpu->prev_migrate = 0;
+    kschd_place(prev);
+  }
+}
 
-  //TODO dynamic based on priority
-  CURRENT_PROC->state->tick_count = 20;
+/**
+ * Pick how this core's timer ticks for the process about to run
+ * Ticks are only needed to end slices between runnable processes,
+ * otherwise the timer fires once for the next sleeper to wake or
+ * at the end of the slice, or not at all (core lock held)
+ * @param cpu  this core
+ * @param next the process about to run
+ */
+static void kschd_tick_update(kcpu_t* cpu, kpcb_t* next) {
+  if (cpu->nr_queued > 0) {
+    timer_tick_periodic();
+    return;
+  }
+
+  uint64_t deadline = 0;
+  if (next != cpu->idle) {
+    //work queued later waits at most this slice, as with ticks
+    deadline = timer_tick_deadline(next->state->tick_count);
+  }
+  if ((cpu->sleepers != NULL) &&
+      ((deadline == 0) || (cpu->sleepers->wake_at < deadline))) {
+    deadline = cpu->sleepers->wake_at;
+  }
+
+  if (deadline == 0) {
+    timer_tick_stop();
+  } else {
+    timer_tick_oneshot(deadline);
+  }
+}
+
+/**
+ * Switch to the next process on this core
+ * Called with the core lock held, which is released before switching
+ * @param cpu   this core
+ * @param flags the irq state from locking the core
+ */
+static void kschd_schedule_locked(kcpu_t* cpu, uint64_t flags) {
+  //requeue the process relinquishing the cpu if it can still run,
+  //blocked and exited processes stay off the run queues
+  kpcb_t *curr = cpu->curr;
+  uint8_t migrate = 0;
+  update_curr(cpu);
+  if (curr != cpu->idle) {
+    kschd_slice_end(curr);
+  }
+  if ((curr != cpu->idle) && (curr->stat == PROC_RUNNING)) {
+    if (kschd_allowed(curr,cpu - KCPUS)) {
+      enqueue_kproc(cpu,curr);
+    } else {
+      migrate = 1;
+    }
+  }
+
+  kpcb_t *next = dequeue_kproc(cpu);
+  if (next == NULL) {
+    next = cpu->idle;
+  }
+
+  next->state->tick_count = runq_slice(cpu,next);
+  kschd_tick_update(cpu,next);
+
+  if (next == curr) {
+    kspin_unlock_irqrestore(&cpu->lock,flags);
+    return;
+  }
+  //a process woken onto another core may still be
+  //switching out on the core it blocked on
+  while (__atomic_load_n(&next->on_cpu,__ATOMIC_ACQUIRE)) {}
+
+  next->on_cpu = 1;
+  next->exec_start = get_sys_count();
+  cpu->curr = next;
+  cpu->prev = curr;
+  cpu->prev_migrate = migrate;
+  cpu->switches++;
+  kspin_unlock_irqrestore(&cpu->lock,flags);
 
   //context switch, starts executing new process
-  cpu_context_switch(curr->state, CURRENT_PROC->state);
+  cpu_context_switch(curr->state, next->state);
+  //resumed, possibly much later
+  kschd_finish_switch();
+}
+
+/**
+ * Schedule a new process on this core
+ */
+void kschd_schedule() {
+  kcpu_t* cpu = this_kcpu();
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  kschd_schedule_locked(cpu,flags);
+}
+
+/**
+ * Move one queued process from the busiest other core to
+ * this core's run queue (called from the idle process)
+ * @return 1 if a process was taken
+ */
+static uint8_t kschd_steal() {
+  kcpu_t* self = this_kcpu();
+  uint8_t core = self - KCPUS;
+
+  //busiest peer that is running something and has more queued,
+  //an idle peer picks up its own queue shortly
+  kcpu_t* victim = NULL;
+  for (uint8_t c=0; c<SMP_CORES; c++) {
+    kcpu_t* cpu = &KCPUS[c];
+    if ((cpu == self) || !cpu->online || (cpu->nr_queued == 0) ||
+        (cpu->curr == cpu->idle)) {
+      continue;
+    }
+    if ((victim == NULL) || (cpu->nr_queued > victim->nr_queued)) {
+      victim = cpu;
+    }
+  }
+  if (victim == NULL) {
+    return 0;
+  }
+
+  uint64_t flags = kschd_lock_pair(self,victim);
+
+  kpcb_t* pcb = runq_steal_pick(victim,core);
+  if (pcb != NULL) {
+    runq_remove(victim,pcb);
+    runq_migrate(victim,self,pcb);
+    pcb->cpu = core;
+    enqueue_kproc(self,pcb);
+    self->steals++;
+    self->migrations++;
+    victim->stolen++;
+  }
+  kschd_unlock_pair(self,victim,flags);
+  return pcb != NULL;
+}
+
+/**
+ * Sleep in wfi until an interrupt, unless work was queued here
+ * A core queueing work here sees sleeping and sends a wakeup
+ * @param cpu this core
+ */
+static void kschd_idle_wait(kcpu_t* cpu) {
+  //irqs stay masked until after wfi, a wakeup arriving first still ends it
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  //a tick since the last switch left the timer periodic
+  kschd_tick_update(cpu,cpu->idle);
+  __atomic_store_n(&cpu->sleeping,1,__ATOMIC_RELAXED);
+  kspin_unlock(&cpu->lock);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cpu->nr_queued,__ATOMIC_RELAXED) == 0) {
+    uint64_t start = get_sys_count();
+    asm volatile("dsb sy; wfi" ::: "memory");
+    cpu->idle_time += get_sys_count() - start;
+  }
+  __atomic_store_n(&cpu->sleeping,0,__ATOMIC_RELAXED);
+  irq_restore(flags);
+}
+
+/**
+ * Idle process, one per core
+ * Switches to work placed on this core or taken from a busier
+ * one, otherwise refills the zeroed page pool, then sleeps with
+ * the tick stopped
+ */
+void idle_debug() {
+  debug_log("reached idle");
+  while (1) {
+    DISABLE_PREEMPT();
+    kcpu_t* cpu = this_kcpu();
+    if (cpu->nr_queued || kschd_steal()) {
+      kschd_schedule();
+    } else if (!pzero_work()) {
+      //nothing to run or zero, sleep until work is queued here
+      kschd_idle_wait(cpu);
+    }
+    ENABLE_PREEMPT();
+  }
 }
 
 /**
- * Timer interrupt handler
+ * Timer tick, called from the irq handler with irqs masked
+ * Reschedules once the current slice is used up
+ * @param ticks the ticks elapsed since the last call (timer_tick_ack)
  */
-void timer_preempt() {
+void timer_preempt(uint64_t ticks) {
+  kcpu_t* cpu = this_kcpu();
+  cpu->ticks++;
+  //only this core adds to its sleepers
+  if (cpu->sleepers != NULL) {
+    kschd_wake_sleepers(cpu);
+  }
+  if (CURRENT_PROC == NULL) {
+    return;
+  }
 
-  /*
-   * TODO
-   */
-  CURRENT_PROC->state->tick_count--;
+  //a slice that ran out while preemption was disabled
+  //ends on the first tick after it is reenabled
+  if ((uint64_t) CURRENT_PROC->state->tick_count > ticks) {
+    CURRENT_PROC->state->tick_count -= ticks;
+  } else {
+    CURRENT_PROC->state->tick_count = 0;
+  }
 
   if ((CURRENT_PROC->state->tick_count == 0) &&
       (CURRENT_PROC->state->preempt_counter == 0)) {
+    //every switch happens with irqs unmasked so the thread
+    //resumed here does not inherit a masked irq state,
+    //the preempt counter keeps the tick from nesting
+    DISABLE_PREEMPT();
+    enable_irq();
     kschd_schedule();
+    disable_irq();
+    ENABLE_PREEMPT();
   }
 }
 
@@ -169,6 +984,9 @@ void timer_preempt() {
  * @param fn   the function to be called
  */
 void run_kproc(int kpid, uint64_t fn) {
+  //new processes are entered from a context switch
+  kschd_finish_switch();
+
   //process handler
   int (*handler)(int,char**) = (int (*)(int,char**)) fn;
 
@@ -197,49 +1015,114 @@ void run_kproc(int kpid, uint64_t fn) {
   //wake the parent
   kpcb_t* pproc;
   if (get_proc_kpid(CURRENT_PROC->kppid,&pproc) == 0) {
-    CURRENT_PROC->stat = PROC_WAITABLE;
+    //the exit code is visible to a parent on another core first
+    __atomic_store_n(&CURRENT_PROC->stat,PROC_WAITABLE,__ATOMIC_RELEASE);
 
-    if (pproc->stat == PROC_WAITING) {
-      //set parent runnable (wakeup from wait())
-      pproc->stat = PROC_RUNNING;
-    }
+    //wake the parent (and anyone else) blocked in kwaitpid()
+    wake_up_all(&pproc->child_exit);
   } else {
     //zombied
     CURRENT_PROC->stat = PROC_ZOMBIED;
   }
-  //TODO add to parent waitable queue
 
   //find a new process to schedule
   kschd_schedule();
 }
 
+/**
+ * Allocate a process control block, its state and its stack
+ * @param  kpid the process id
+ * @param  fn   the function the process runs
+ * @return      the pcb, NULL on error
+ */
+kpcb_t* alloc_kproc(uint64_t kpid, uint64_t fn) {
+  kpcb_t* pcb = (kpcb_t*) kmem_cache_alloc(KPCB_CACHE);
+  if (pcb == NULL) {
+    return NULL;
+  }
+  pcb->state = (kproc_state_t*) kmem_cache_alloc(KSTATE_CACHE);
+  //the stack is written before it is read
+  pcb->stack = palloc_nozero();
+  if ((pcb->state == NULL) || (pcb->stack == NULL)) {
+    kmem_cache_free(KSTATE_CACHE,pcb->state);
+    pfree(pcb->stack);
+    kmem_cache_free(KPCB_CACHE,pcb);
+    return NULL;
+  }
+
+  memset(pcb->state,0,sizeof(kproc_state_t));
+  pcb->state->regs.x19 = (uint64_t) run_kproc;
+  pcb->state->regs.x20 = kpid;
+  pcb->state->regs.x21 = fn;
+  pcb->state->regs.pc = (uint64_t) call_proc;
+  pcb->state->regs.sp = (uint64_t) pcb->stack + THREAD_SIZE;
+  //not preemptible until run_kproc starts the handler
+  pcb->state->preempt_counter = 1;
+  pcb->state->tick_count = 0;
+  pcb->kpid = kpid;
+  pcb->priority = PRIORITY_MED;
+  pcb->run_priority = PRIORITY_MED;
+  pcb->interactivity = 0;
+  pcb->flags = 0;
+  pcb->stat = PROC_RUNNING;
+  pcb->argc = 0;
+  pcb->argv = NULL;
+  pcb->exit_code = 0;
+  pcb->arena = NULL;
+  pcb->cpu = 0;
+  pcb->affinity = KSCHD_AFFINITY_ALL;
+  pcb->on_cpu = 0;
+  pcb->on_rq = 0;
+  pcb->wake_pending = 0;
+  pcb->wake_at = 0;
+  pcb->sleep_next = NULL;
+  pcb->wait_q = NULL;
+  pcb->wait_next = NULL;
+  pcb->wait_prev = NULL;
+  init_kwait_queue(&pcb->child_exit);
+  pcb->nice = 0;
+  pcb->weight = KSCHD_NICE_0_WEIGHT;
+  pcb->vruntime = 0;
+  pcb->exec_start = 0;
+  pcb->next = NULL;
+  pcb->prev = NULL;
+
+  //findable by id until it is freed
+  kpid_bind(kpid,pcb);
+  return pcb;
+}
+
 /**
  * Initialize the kernel process scheduler
  */
 void init_kschd() {
-  //create idle process
-  kpcb_t* idle = (kpcb_t*) kmalloc(sizeof(kpcb_t));
-  idle->state = (kproc_state_t*) palloc();
-  idle->state->regs.x19 = (uint64_t) run_kproc;
-  idle->state->regs.x20 = 0;
-  idle->state->regs.x21 = (uint64_t) idle_debug;
-  idle->state->regs.pc = (uint64_t) call_proc;
-  idle->state->regs.sp = (uint64_t) idle->state + THREAD_SIZE;
-  idle->state->preempt_counter = 0;
-  idle->state->tick_count = 0;
-  idle->kppid = -1;
-  idle->kpid = 0;
-  idle->priority = PRIORITY_LOW;
-  idle->flags = 0;
-  idle->stat = PROC_RUNNING;
-  idle->argc = 0;
-  idle->argv = NULL;
-  idle->exit_code = 0;
-  idle->next = NULL;
-  idle->prev = NULL;
-
-  //add to runnable queue
-  enqueue_kproc(idle);
+  KPCB_CACHE = kmem_cache_create("kpcb_t",sizeof(kpcb_t));
+#ifdef KSCHD_CFS
+  KSCHD_PERIOD_COUNT = (get_sys_freq() * KSCHD_TUNE.period_ms) / 1000;
+#endif
+  KSTATE_CACHE = kmem_cache_create("kproc_state_t",sizeof(kproc_state_t));
+
+  //the idle processes take the first ids (core 0's is 0)
+  init_kpid();
+  for (uint8_t c=0; c<SMP_CORES; c++) {
+    kcpu_t* cpu = &KCPUS[c];
+    memset(cpu,0,sizeof(kcpu_t));
+
+    kpcb_t* idle = alloc_kproc(kpid_alloc(),(uint64_t) idle_debug);
+    if (idle == NULL) {
+      debug_err("unable to create idle process");
+      return;
+    }
+    idle->kppid = -1;
+    idle->priority = PRIORITY_LOW;
+    idle->run_priority = PRIORITY_LOW;
+    idle->cpu = c;
+    cpu->idle = idle;
+  }
+
+  //threads created before the scheduler starts go to the boot core
+  asm volatile("msr tpidr_el1, %0" :: "r"(&KCPUS[0]));
+  KCPUS[0].online = 1;
 }
 
 /**
@@ -249,10 +1132,21 @@ void init_kschd() {
  */
 void set_curr_proc_state(kproc_stat stat) {
   DISABLE_PREEMPT();
-  CURRENT_PROC->stat = stat;
-  if (stat == PROC_WAITING) {
-    //schedule a new task
-    kschd_schedule();
+  kcpu_t* cpu = this_kcpu();
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  kpcb_t* curr = cpu->curr;
+
+  if ((stat == PROC_WAITING) && curr->wake_pending) {
+    //woken before it could block
+    curr->wake_pending = 0;
+    kspin_unlock_irqrestore(&cpu->lock,flags);
+  } else if (stat == PROC_WAITING) {
+    //blocking and switching away are atomic with respect to wakers
+    curr->stat = stat;
+    kschd_schedule_locked(cpu,flags);
+  } else {
+    curr->stat = stat;
+    kspin_unlock_irqrestore(&cpu->lock,flags);
   }
   ENABLE_PREEMPT();
 }
@@ -263,19 +1157,57 @@ void set_curr_proc_state(kproc_stat stat) {
  */
 void free_kproc(kpcb_t* pcb) {
   DISABLE_PREEMPT();
-  if (pcb->prev != NULL) {
-    pcb->prev->next = pcb->next;
-  }
-  if (pcb->next != NULL) {
-    pcb->next->prev = pcb->prev;
-  }
+  //exited processes are no longer on a run queue,
+  //the id stops resolving and can be reused
+  kpid_free(pcb->kpid);
+
+  //its core may still be switching away from it
+  while (__atomic_load_n(&pcb->on_cpu,__ATOMIC_ACQUIRE)) {}
 
   //free the memory allocations
-  pfree(pcb->state);
-  kfree(pcb);
+  for (uint8_t i=0; i<pcb->argc; i++) {
+    kfree(pcb->argv[i]);
+  }
+  kfree(pcb->argv);
+  karena_destroy(pcb->arena);
+  pfree(pcb->stack);
+  kmem_cache_free(KSTATE_CACHE,pcb->state);
+  kmem_cache_free(KPCB_CACHE,pcb);
   ENABLE_PREEMPT();
 }
 
+/**
+ * Get the current process
+ * @return the process control block
+ */
+kpcb_t* kthread_current() {
+  //the core and its current process are read together
+  uint64_t flags = irq_save();
+  kpcb_t* curr = CURRENT_PROC;
+  irq_restore(flags);
+  return curr;
+}
+
+/**
+ * Get the scratch arena of the current process, created on first use
+ * Freed when the process is reaped
+ * @return the arena, NULL on error
+ */
+karena_t* kthread_arena() {
+  //read the current process once, it must not migrate in between
+  DISABLE_PREEMPT();
+  kpcb_t* curr = kthread_current();
+  karena_t* arena = NULL;
+  if (curr != NULL) {
+    if (curr->arena == NULL) {
+      curr->arena = karena_create();
+    }
+    arena = curr->arena;
+  }
+  ENABLE_PREEMPT();
+  return arena;
+}
+
 /**
  * Find a process by process id
  * @param  kpid the id of the process
@@ -284,36 +1216,14 @@ void free_kproc(kpcb_t* pcb) {
  */
 uint8_t get_proc_kpid(uint64_t kpid, kpcb_t** pcb) {
   DISABLE_PREEMPT();
+  kpcb_t* found = kpid_lookup(kpid);
+  ENABLE_PREEMPT();
 
-  if ((CURRENT_PROC != NULL) && (CURRENT_PROC->kpid == kpid)) {
-    *pcb = CURRENT_PROC;
-    ENABLE_PREEMPT();
-    return 0;
+  if (found == NULL) {
+    return 1;
   }
-
-  for (int p=0; p<3; p++) {
-    //check highest pri processes
-    kpcb_t* curr_queue;
-
-    if (p == 0) {
-      curr_queue = KTHREADS_PRI0;
-    } else if (p == 1) {
-      curr_queue = KTHREADS_PRI1;
-    } else {
-      curr_queue = KTHREADS_PRI2;
-    }
-
-    //look for the process by id
-    while (curr_queue != NULL) {
-      if (curr_queue->kpid == kpid) {
-        *pcb = curr_queue;
-        ENABLE_PREEMPT();
-        return 0;
-      }
-    }
-  }
-  ENABLE_PREEMPT();
-  return 1;
+  *pcb = found;
+  return 0;
 }
 
 /**
@@ -333,61 +1243,282 @@ uint64_t kthread_create(uint64_t kthread_fn,
   DISABLE_PREEMPT();
 
   //get the next processid
-  LAST_KPID++;
+  uint64_t kpid = kpid_alloc();
+  if (kpid == KPID_NONE) {
+    debug_err("out of process ids");
+    ENABLE_PREEMPT();
+    return -1;
+  }
 
   //allocate a new kernel pcb
-  kpcb_t* new_proc = (kpcb_t*) kmalloc(sizeof(kpcb_t));
-  new_proc->state = (kproc_state_t*) palloc();
+  kpcb_t* new_proc = alloc_kproc(kpid,kthread_fn);
+  if (new_proc == NULL) {
+    debug_err("unable to allocate process");
+    kpid_free(kpid);
+    ENABLE_PREEMPT();
+    return -1;
+  }
 
-  //parent is the current running process
-  new_proc->kppid = CURRENT_PROC->kpid;
-  new_proc->kpid = LAST_KPID;
-  new_proc->priority = PRIORITY_HIGH;
+  //parent is the current running process (idle before the scheduler starts)
+  new_proc->kppid = (CURRENT_PROC != NULL) ? CURRENT_PROC->kpid : 0;
+  //medium leaves room to be boosted or to decay
+  new_proc->priority = PRIORITY_MED;
   new_proc->flags = flags;
-  new_proc->stat = PROC_RUNNING;
   new_proc->argc = argc + 1;
   new_proc->argv = (char**) kmalloc(sizeof(char*) * (argc + 1));
-  new_proc->exit_code = 0;
 
   //first arg is name or process
   uint32_t slen = strlen(tname);
-  new_proc->argv[0] = (char*) kmalloc(slen);
-  memcpy(new_proc->argv[0],tname,slen);
+  new_proc->argv[0] = (char*) kmalloc(slen + 1);
+  memcpy(new_proc->argv[0],tname,slen + 1);
 
   if (argc > 0) {
     //copy args
     for (uint8_t i=0; i<argc; i++) {
       slen = strlen(argv[i]);
-      new_proc->argv[i+1] = (char*) kmalloc(slen);
-      memcpy(new_proc->argv[i+1],argv[i],slen);
+      new_proc->argv[i+1] = (char*) kmalloc(slen + 1);
+      memcpy(new_proc->argv[i+1],argv[i],slen + 1);
     }
   }
 
-  //cpu state
-  new_proc->state->regs.x19 = (uint64_t) run_kproc;
-  new_proc->state->regs.x20 = LAST_KPID;
-  new_proc->state->regs.x21 = kthread_fn;
-  new_proc->state->regs.pc = (uint64_t) call_proc;
-  new_proc->state->regs.sp = (uint64_t) new_proc->state + THREAD_SIZE;
-  new_proc->state->preempt_counter = 0;
-  new_proc->state->tick_count = 0;
-
-  //add this process to the runnable queue
-  enqueue_kproc(new_proc);
+  //add this process to the runnable queue of the least loaded core
+  kschd_place(new_proc);
 
   //reenable preemption on this process
   ENABLE_PREEMPT();
 
-  return LAST_KPID;
+  return kpid;
 }
 
 /**
- * Start the scheduler
- * Runs highest priority process
+ * Restrict the cores a process may run on
+ * A queued process moves at once, a running one when it is next
+ * preempted and a blocked one when it is woken
+ * @param  kpid the process id
+ * @param  mask bit n set if the process may run on core n
+ * @return      0 on success, pos if not found or no core is allowed
  */
-void kschd_start() {
-  kpcb_t *startup_proc = dequeue_kproc();
-  CURRENT_PROC = startup_proc;
+uint8_t kthread_set_affinity(uint64_t kpid, uint8_t mask) {
+  mask &= KSCHD_AFFINITY_ALL;
+  kpcb_t* pcb;
+  if ((mask == 0) || get_proc_kpid(kpid,&pcb)) {
+    return 1;
+  }
+
+  DISABLE_PREEMPT();
+  uint8_t place = 0;
+  uint64_t flags;
+  kcpu_t* cpu = kschd_lock_task(pcb,&flags);
+  pcb->affinity = mask;
+  if (pcb->on_rq && !kschd_allowed(pcb,pcb->cpu)) {
+    runq_remove(cpu,pcb);
+    place = 1;
+  }
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+
+  if (place) {
+    kschd_place(pcb);
+  }
+  ENABLE_PREEMPT();
+  return 0;
+}
+
+/**
+ * Get the cpu share weight of a niceness
+ * A process gets weight / (sum of runnable weights) of its core
+ * under the fair policy
+ * @param  nice the niceness (clamped to the range)
+ * @return      the weight, 1024 for nice 0
+ */
+uint32_t kschd_nice_weight(int8_t nice) {
+  if (nice < KSCHD_NICE_MIN) {
+    nice = KSCHD_NICE_MIN;
+  } else if (nice > KSCHD_NICE_MAX) {
+    nice = KSCHD_NICE_MAX;
+  }
+  return KSCHD_NICE_WEIGHTS[nice - KSCHD_NICE_MIN];
+}
+
+/**
+ * Set the niceness of a process
+ * With the fair policy (make CFS=1) this sets its share of cpu time,
+ * otherwise nice < 0 runs at high priority, 0-9 medium and 10+ low
+ * @param  kpid the process id
+ * @param  nice KSCHD_NICE_MIN (most cpu) to KSCHD_NICE_MAX (least)
+ * @return      0 on success, pos if not found or out of range
+ */
+uint8_t kthread_set_nice(uint64_t kpid, int8_t nice) {
+  kpcb_t* pcb;
+  if ((nice < KSCHD_NICE_MIN) || (nice > KSCHD_NICE_MAX) ||
+      get_proc_kpid(kpid,&pcb)) {
+    return 1;
+  }
+
+  DISABLE_PREEMPT();
+  uint64_t flags;
+  kcpu_t* cpu = kschd_lock_task(pcb,&flags);
+  //the queue position and core load depend on the weight and priority
+  uint8_t queued = pcb->on_rq;
+  if (queued) {
+    runq_remove(cpu,pcb);
+  }
+  pcb->nice = nice;
+  pcb->weight = kschd_nice_weight(nice);
+  if (nice < 0) {
+    pcb->priority = PRIORITY_HIGH;
+  } else if (nice < 10) {
+    pcb->priority = PRIORITY_MED;
+  } else {
+    pcb->priority = PRIORITY_LOW;
+  }
+  if (queued) {
+    enqueue_kproc(cpu,pcb);
+  }
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+  ENABLE_PREEMPT();
+  return 0;
+}
+
+/**
+ * Block the current process for a time
+ * Returns early if the process is woken (kschd_wake)
+ * @param ms the time in milliseconds
+ */
+void kthread_sleep_ms(uint64_t ms) {
+  DISABLE_PREEMPT();
+  kcpu_t* cpu = this_kcpu();
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  kpcb_t* curr = cpu->curr;
+
+  //0 marks a process that is not sleeping
+  curr->wake_at = get_sys_count() + ((get_sys_freq() * ms) / 1000) + 1;
+  kpcb_t** link = &cpu->sleepers;
+  while ((*link != NULL) && ((*link)->wake_at <= curr->wake_at)) {
+    link = &(*link)->sleep_next;
+  }
+  curr->sleep_next = *link;
+  *link = curr;
+
+  //the switch programs the timer for the soonest sleeper
+  curr->stat = PROC_WAITING;
+  kschd_schedule_locked(cpu,flags);
+  ENABLE_PREEMPT();
+}
+
+/**
+ * Give up the rest of the current slice
+ * Counts as ending the slice early, like blocking
+ */
+void kthread_yield() {
+  DISABLE_PREEMPT();
+  kschd_schedule();
+  ENABLE_PREEMPT();
+}
+
+/**
+ * Get the scheduling parameters
+ * @param tune the parameters (set)
+ */
+void kschd_get_tunables(kschd_tunables_t* tune) {
+  memcpy(tune,&KSCHD_TUNE,sizeof(kschd_tunables_t));
+}
+
+/**
+ * Set the scheduling parameters, applied from the next slice
+ * @param  tune the parameters
+ * @return      0 on success, pos if a value is out of range
+ */
+uint8_t kschd_set_tunables(const kschd_tunables_t* tune) {
+  for (uint8_t p=0; p<PRIORITY_LEVELS; p++) {
+    if ((tune->slice_ms[p] == 0) || (tune->slice_ms[p] > 1000)) {
+      return 1;
+    }
+  }
+  if ((tune->boost_after > KSCHD_INTERACTIVITY_MAX) ||
+      (tune->decay_after > KSCHD_INTERACTIVITY_MAX) ||
+      (tune->min_slice_ms == 0) ||
+      (tune->period_ms < tune->min_slice_ms) ||
+      (tune->period_ms > 1000)) {
+    return 1;
+  }
+
+  //read by the cores unlocked, a slice started mid update
+  //mixes old and new values at worst
+  memcpy(&KSCHD_TUNE,tune,sizeof(kschd_tunables_t));
+#ifdef KSCHD_CFS
+  KSCHD_PERIOD_COUNT = (get_sys_freq() * tune->period_ms) / 1000;
+#endif
+  return 0;
+}
+
+/**
+ * Get the scheduler counters of a core
+ * @param  core  the core id
+ * @param  stats the counters (set)
+ * @return       0 on success, pos if there is no such core
+ */
+uint8_t kschd_get_cpu_stats(uint8_t core, kschd_cpu_stats_t* stats) {
+  if (core >= SMP_CORES) {
+    return 1;
+  }
+  kcpu_t* cpu = &KCPUS[core];
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  stats->online = cpu->online;
+  stats->queued = cpu->nr_queued;
+  stats->switches = cpu->switches;
+  stats->steals = cpu->steals;
+  stats->stolen = cpu->stolen;
+  stats->migrations = cpu->migrations;
+  stats->ticks = cpu->ticks;
+  stats->idle_us = ticks_to_us(cpu->idle_time);
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+  return 0;
+}
+
+/**
+ * Start scheduling on this core
+ * Runs the highest priority process queued here (or idle)
+ * on the boot stack, no return
+ */
+static void kschd_run_core() {
+  kcpu_t* cpu = this_kcpu();
+  //irqs stay masked until the first process is set up
+  init_timer_tick(KTIMER_HZ);
+
+  uint64_t flags = kspin_lock_irqsave(&cpu->lock);
+  kpcb_t *startup_proc = dequeue_kproc(cpu);
+  if (startup_proc == NULL) {
+    startup_proc = cpu->idle;
+  }
+  startup_proc->on_cpu = 1;
+  startup_proc->exec_start = get_sys_count();
+  startup_proc->state->tick_count = runq_slice(cpu,startup_proc);
+  cpu->curr = startup_proc;
+  cpu->online = 1;
+  kschd_tick_update(cpu,startup_proc);
+  kspin_unlock_irqrestore(&cpu->lock,flags);
+
+  //start time slicing
+  enable_irq();
+
   run_kproc(startup_proc->kpid,
             startup_proc->state->regs.x21);
 }
+
+/**
+ * Start the scheduler
+ * Brings up the secondary cores, then runs the highest
+ * priority process on the boot core
+ */
+void kschd_start() {
+  debug_val("cores running",smp_start_cores());
+  kschd_run_core();
+}
+
+/**
+ * Start the scheduler on a secondary core (no return)
+ */
+void kschd_start_secondary() {
+  asm volatile("msr tpidr_el1, %0" :: "r"(&KCPUS[get_core_id()]));
+  kschd_run_core();
+}
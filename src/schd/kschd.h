@@ -9,10 +9,64 @@
 #include <stddef.h>
 #include <stdnoreturn.h>
 #include "kpcb.h"
+#include "../smp/smp.h"
 
 //page size
 #define THREAD_SIZE 4096
 
+//a process may run on any core (kthread_set_affinity)
+#define KSCHD_AFFINITY_ALL ((1 << SMP_CORES) - 1)
+
+//niceness range (kthread_set_nice), new processes are 0
+#define KSCHD_NICE_MIN -20
+#define KSCHD_NICE_MAX 19
+
+//priority levels of the priority policy (high, medium, low)
+#define KSCHD_LEVELS 3
+//interactivity saturates at +/- this many slices
+#define KSCHD_INTERACTIVITY_MAX 16
+
+/*
+ * Scheduling parameters (kschd_set_tunables)
+ */
+typedef struct kschd_tunables_t {
+  //slice length by priority level, hogs decay to the longer low slices
+  uint32_t slice_ms[KSCHD_LEVELS];
+  //net slices ended early (blocked or yielded) before a process
+  //is queued one level higher, 0 disables
+  uint32_t boost_after;
+  //net slices used up before a process is queued one level lower,
+  //0 disables
+  uint32_t decay_after;
+  //fair policy (make CFS=1): every runnable process runs once per period,
+  //slices are a weighted share of it but no shorter than min_slice_ms
+  uint32_t period_ms;
+  uint32_t min_slice_ms;
+} kschd_tunables_t;
+
+/*
+ * Scheduler counters of one core
+ */
+typedef struct kschd_cpu_stats_t {
+  //whether the core is scheduling
+  uint8_t online;
+  //processes waiting on the core's run queues
+  uint32_t queued;
+  //context switches
+  uint64_t switches;
+  //processes the core took from busier cores
+  uint64_t steals;
+  //processes other cores took from this one
+  uint64_t stolen;
+  //processes moved onto the core from another core
+  uint64_t migrations;
+  //timer interrupts taken (none while idle, one per slice when
+  //a process runs alone)
+  uint64_t ticks;
+  //time spent asleep in wfi waiting for work
+  uint64_t idle_us;
+} kschd_cpu_stats_t;
+
 /**
  * Initialize the kernel process scheduler
  */
@@ -21,16 +75,44 @@ void init_kschd();
 /**
  * Set the status of the current running process
  * If the status is set to PROC_WAITING a new proc is scheduled
+ * until kschd_wake() (block through a wait queue, see kwait.h)
  * @param stat the status
  */
 void set_curr_proc_state(kproc_stat stat);
 
+/**
+ * Make a blocked process runnable again on its core
+ * A process that has not blocked yet keeps the wakeup
+ * and does not block on its next wait
+ * @param pcb the process control block
+ */
+void kschd_wake(kpcb_t* pcb);
+
+/**
+ * Drop a wakeup the current process received without blocking
+ * (its wait condition was already true)
+ */
+void kschd_clear_wake();
+
+/**
+ * Get the current process
+ * @return the process control block
+ */
+kpcb_t* kthread_current();
+
 /**
  * Free a process
  * @param pcb the process control block to free
  */
 void free_kproc(kpcb_t* pcb);
 
+/**
+ * Get the scratch arena of the current process, created on first use
+ * Freed when the process is reaped
+ * @return the arena, NULL on error
+ */
+karena_t* kthread_arena();
+
 /**
  * Find a process by process id
  * @param  kpid the id of the process
@@ -54,10 +136,87 @@ uint64_t kthread_create(uint64_t kthread_fn,
                         char *argv[],
                         uint8_t flags);
 
+/**
+ * Timer tick, called from the irq handler with irqs masked
+ * Reschedules once the current slice is used up
+ * @param ticks the ticks elapsed since the last call (timer_tick_ack)
+ */
+void timer_preempt(uint64_t ticks);
+
+/**
+ * Restrict the cores a process may run on
+ * A queued process moves at once, a running one when it is next
+ * preempted and a blocked one when it is woken
+ * @param  kpid the process id
+ * @param  mask bit n set if the process may run on core n
+ * @return      0 on success, pos if not found or no core is allowed
+ */
+uint8_t kthread_set_affinity(uint64_t kpid, uint8_t mask);
+
+/**
+ * Set the niceness of a process
+ * With the fair policy (make CFS=1) this sets its share of cpu time,
+ * otherwise nice < 0 runs at high priority, 0-9 medium and 10+ low
+ * @param  kpid the process id
+ * @param  nice KSCHD_NICE_MIN (most cpu) to KSCHD_NICE_MAX (least)
+ * @return      0 on success, pos if not found or out of range
+ */
+uint8_t kthread_set_nice(uint64_t kpid, int8_t nice);
+
+/**
+ * Get the cpu share weight of a niceness
+ * A process gets weight / (sum of runnable weights) of its core
+ * under the fair policy
+ * @param  nice the niceness (clamped to the range)
+ * @return      the weight, 1024 for nice 0
+ */
+uint32_t kschd_nice_weight(int8_t nice);
+
+/**
+ * Block the current process for a time
+ * Returns early if the process is woken (kschd_wake)
+ * @param ms the time in milliseconds
+ */
+void kthread_sleep_ms(uint64_t ms);
+
+/**
+ * Give up the rest of the current slice
+ * Counts as ending the slice early, like blocking
+ */
+void kthread_yield();
+
+/**
+ * Get the scheduling parameters
+ * @param tune the parameters (set)
+ */
+void kschd_get_tunables(kschd_tunables_t* tune);
+
+/**
+ * Set the scheduling parameters, applied from the next slice
+ * @param  tune the parameters
+ * @return      0 on success, pos if a value is out of range
+ */
+uint8_t kschd_set_tunables(const kschd_tunables_t* tune);
+
+/**
+ * Get the scheduler counters of a core
+ * @param  core  the core id
+ * @param  stats the counters (set)
+ * @return       0 on success, pos if there is no such core
+ */
+uint8_t kschd_get_cpu_stats(uint8_t core, kschd_cpu_stats_t* stats);
+
 /**
  * Start the scheduler
+ * Brings up the secondary cores, then runs the highest
+ * priority process on the boot core
  */
 void kschd_start();
 
+/**
+ * Start the scheduler on a secondary core (no return)
+ */
+void kschd_start_secondary();
+
 
 #endif /*_SCHD_KSCHD_H*/
@@ -0,0 +1,191 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifdef KBENCH
+
+#include "kschd_bench.h"
+#include "kschd.h"
+#include "kproc.h"
+#include "../timer/timer.h"
+#include "../uart/debug.h"
+
+//threads per niceness
+#define KBENCH_SCHD_PER_NICE 4
+//niceness levels competing
+#define KBENCH_SCHD_LEVELS 3
+#define KBENCH_SCHD_THREADS (KBENCH_SCHD_PER_NICE * KBENCH_SCHD_LEVELS)
+//time for the threads to move to the benchmark core before starting
+#define KBENCH_SCHD_SETTLE_MS 100
+//a gap between two counter reads longer than this was spent switched out
+#define KBENCH_SCHD_GAP_US 50
+
+static const int8_t KBENCH_SCHD_NICE[KBENCH_SCHD_LEVELS] = {0, 5, 10};
+
+/*
+ * What one benchmark thread measured
+ */
+typedef struct kbench_schd_t {
+  //counter ticks spent running
+  uint64_t run;
+  //times switched out, the longest and total time switched out
+  uint64_t waits;
+  uint64_t wait_max;
+  uint64_t wait_total;
+} kbench_schd_t;
+
+kbench_schd_t KBENCH_SCHD[KBENCH_SCHD_THREADS];
+
+//the competition window and switched out threshold in counter ticks
+volatile uint64_t KBENCH_SCHD_START = 0;
+volatile uint64_t KBENCH_SCHD_END = 0;
+uint64_t KBENCH_SCHD_GAP = 0;
+
+/**
+ * Benchmark thread, spins reading the counter for the window
+ * argv[1] is the thread's result slot
+ * @return 0
+ */
+static int bench_schd_thread(int argc, char **argv) {
+  if (argc < 2) {
+    return 1;
+  }
+  uint64_t slot = 0;
+  for (char* c = argv[1]; (*c >= '0') && (*c <= '9'); c++) {
+    slot = (slot * 10) + (*c - '0');
+  }
+  kbench_schd_t* res = &KBENCH_SCHD[slot % KBENCH_SCHD_THREADS];
+
+  while (get_sys_count() < KBENCH_SCHD_START) {}
+
+  uint64_t last = KBENCH_SCHD_START;
+  while (1) {
+    uint64_t now = get_sys_count();
+    if (now > KBENCH_SCHD_END) {
+      now = KBENCH_SCHD_END;
+    }
+    uint64_t gap = now - last;
+    if (gap > KBENCH_SCHD_GAP) {
+      res->waits++;
+      res->wait_total += gap;
+      if (gap > res->wait_max) {
+        res->wait_max = gap;
+      }
+    } else {
+      res->run += gap;
+    }
+    last = now;
+    if (now >= KBENCH_SCHD_END) {
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Run cpu bound threads of mixed niceness on one core and log
+ * each niceness's share of the core against its weighted fair
+ * share, the longest and average waits to run, and the fairness
+ * index over all threads
+ * Called from a kernel thread once the scheduler has started
+ * @param  ms how long the threads compete
+ * @return    0 on success, pos if a thread could not be created
+ */
+uint8_t kbench_kschd(uint64_t ms) {
+#ifdef KSCHD_CFS
+  debug_log("kbench kschd: fair (vruntime)");
+#else
+  debug_log("kbench kschd: strict priority");
+#endif
+
+  //compete on the last online core, away from the caller where possible
+  uint8_t core = 0;
+  for (uint8_t c=0; c<SMP_CORES; c++) {
+    kschd_cpu_stats_t stats;
+    if ((kschd_get_cpu_stats(c,&stats) == 0) && stats.online) {
+      core = c;
+    }
+  }
+
+  uint64_t freq = get_sys_freq();
+  KBENCH_SCHD_GAP = (freq * KBENCH_SCHD_GAP_US) / 1000000;
+  KBENCH_SCHD_START = get_sys_count() + ((freq * KBENCH_SCHD_SETTLE_MS) / 1000);
+  KBENCH_SCHD_END = KBENCH_SCHD_START + ((freq * ms) / 1000);
+
+  uint64_t kpids[KBENCH_SCHD_THREADS];
+  uint64_t total_weight = 0;
+  uint8_t created = 0;
+  for (uint8_t i=0; i<KBENCH_SCHD_THREADS; i++) {
+    KBENCH_SCHD[i].run = 0;
+    KBENCH_SCHD[i].waits = 0;
+    KBENCH_SCHD[i].wait_max = 0;
+    KBENCH_SCHD[i].wait_total = 0;
+
+    char slot[4];
+    itoa(i,slot);
+    char *argv[1] = {slot};
+    kpids[i] = kthread_create((uint64_t) &bench_schd_thread,
+                              "kbench_schd", 1, argv, 0);
+    if (kpids[i] == (uint64_t) -1) {
+      break;
+    }
+    int8_t nice = KBENCH_SCHD_NICE[i / KBENCH_SCHD_PER_NICE];
+    kthread_set_nice(kpids[i],nice);
+    kthread_set_affinity(kpids[i],1 << core);
+    total_weight += kschd_nice_weight(nice);
+    created++;
+  }
+
+  //threads exit at the end of the window (starved ones as soon as they run)
+  for (uint8_t i=0; i<created; i++) {
+    uint16_t stat;
+    kwaitpid(kpids[i],&stat,0);
+  }
+  if (created < KBENCH_SCHD_THREADS) {
+    debug_err("kbench kschd: unable to create threads");
+    return 1;
+  }
+
+  uint64_t window = KBENCH_SCHD_END - KBENCH_SCHD_START;
+  debug_val("bench core",core);
+  debug_val("bench us",ticks_to_us(window));
+
+  //jain's index over each thread's share relative to its fair share:
+  //(sum x)^2 / (n * sum x^2), 1000 when every thread got its fair share
+  uint64_t sum = 0;
+  uint64_t sum_sq = 0;
+  for (uint8_t l=0; l<KBENCH_SCHD_LEVELS; l++) {
+    int8_t nice = KBENCH_SCHD_NICE[l];
+    uint64_t fair = (window * kschd_nice_weight(nice)) / total_weight;
+    uint64_t run = 0;
+    uint64_t waits = 0;
+    uint64_t wait_total = 0;
+    uint64_t wait_max = 0;
+    for (uint8_t i=l * KBENCH_SCHD_PER_NICE; i<(l + 1) * KBENCH_SCHD_PER_NICE; i++) {
+      kbench_schd_t* res = &KBENCH_SCHD[i];
+      uint64_t x = (fair > 0) ? (res->run * 1000) / fair : 0;
+      sum += x;
+      sum_sq += x * x;
+      run += res->run;
+      waits += res->waits;
+      wait_total += res->wait_total;
+      if (res->wait_max > wait_max) {
+        wait_max = res->wait_max;
+      }
+    }
+
+    debug_val("nice",nice);
+    debug_val(" share permille",(run * 1000) / window);
+    debug_val(" fair permille",(fair * KBENCH_SCHD_PER_NICE * 1000) / window);
+    debug_val(" max wait us",ticks_to_us(wait_max));
+    if (waits > 0) {
+      debug_val(" avg wait us",ticks_to_us(wait_total / waits));
+    }
+  }
+  if (sum_sq > 0) {
+    debug_val("fairness x1000",(sum * sum * 1000) / (KBENCH_SCHD_THREADS * sum_sq));
+  }
+  return 0;
+}
+
+#endif
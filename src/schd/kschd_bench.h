@@ -0,0 +1,28 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _SCHD_KSCHD_BENCH_H
+#define _SCHD_KSCHD_BENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Scheduler fairness and latency benchmark (make KBENCH=1)
+ * Build with and without CFS=1 to compare the policies,
+ * results are logged over uart
+ */
+
+/**
+ * Run cpu bound threads of mixed niceness on one core and log
+ * each niceness's share of the core against its weighted fair
+ * share, the longest and average waits to run, and the fairness
+ * index over all threads
+ * Called from a kernel thread once the scheduler has started
+ * @param  ms how long the threads compete
+ * @return    0 on success, pos if a thread could not be created
+ */
+uint8_t kbench_kschd(uint64_t ms);
+
+#endif /*_SCHD_KSCHD_BENCH_H*/
@@ -0,0 +1,122 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "kwait.h"
+#include "kschd.h"
+
+/**
+ * Initialize a wait queue
+ * @param wq the wait queue
+ */
+void init_kwait_queue(kwait_queue_t* wq) {
+  wq->lock.locked = 0;
+  wq->head = NULL;
+  wq->tail = NULL;
+}
+
+/**
+ * Unlink a process from its wait queue (queue lock held)
+ * @param wq  the wait queue
+ * @param pcb the process, on this queue
+ */
+static void kwait_remove(kwait_queue_t* wq, kpcb_t* pcb) {
+  if (pcb->wait_prev != NULL) {
+    pcb->wait_prev->wait_next = pcb->wait_next;
+  } else {
+    wq->head = pcb->wait_next;
+  }
+  if (pcb->wait_next != NULL) {
+    pcb->wait_next->wait_prev = pcb->wait_prev;
+  } else {
+    wq->tail = pcb->wait_prev;
+  }
+  pcb->wait_next = NULL;
+  pcb->wait_prev = NULL;
+  pcb->wait_q = NULL;
+}
+
+/**
+ * Add the current process to the tail of a wait queue, O(1)
+ * (no change if it is already there)
+ * @param wq the wait queue
+ */
+void kwait_prepare(kwait_queue_t* wq) {
+  //irqs masked so the process cannot move cores while it is read
+  uint64_t flags = kspin_lock_irqsave(&wq->lock);
+  kpcb_t* curr = kthread_current();
+  if (curr->wait_q == NULL) {
+    curr->wait_next = NULL;
+    curr->wait_prev = wq->tail;
+    if (wq->tail == NULL) {
+      wq->head = curr;
+    } else {
+      wq->tail->wait_next = curr;
+    }
+    wq->tail = curr;
+    curr->wait_q = wq;
+  }
+  kspin_unlock_irqrestore(&wq->lock,flags);
+}
+
+/**
+ * Block the current process until it is woken
+ * Returns at once if it was woken since kwait_prepare()
+ */
+void kwait_block() {
+  set_curr_proc_state(PROC_WAITING);
+}
+
+/**
+ * Take the current process off a wait queue if a wakeup
+ * did not already, O(1)
+ * A wakeup that arrived without the process blocking is dropped
+ * so it does not cut short the next unrelated wait
+ * @param wq the wait queue
+ */
+void kwait_finish(kwait_queue_t* wq) {
+  uint64_t flags = kspin_lock_irqsave(&wq->lock);
+  kpcb_t* curr = kthread_current();
+  if (curr->wait_q == wq) {
+    kwait_remove(wq,curr);
+  }
+  //off the queue, no waker on it can set this again
+  kschd_clear_wake();
+  kspin_unlock_irqrestore(&wq->lock,flags);
+}
+
+/**
+ * Wake the process that has waited longest, O(1)
+ * @param  wq the wait queue
+ * @return    1 if a process was woken, 0 if none were waiting
+ */
+uint8_t wake_up_one(kwait_queue_t* wq) {
+  //woken under the queue lock so the process cannot
+  //requeue itself elsewhere before it is made runnable
+  uint64_t flags = kspin_lock_irqsave(&wq->lock);
+  kpcb_t* pcb = wq->head;
+  if (pcb != NULL) {
+    kwait_remove(wq,pcb);
+    kschd_wake(pcb);
+  }
+  kspin_unlock_irqrestore(&wq->lock,flags);
+  return pcb != NULL;
+}
+
+/**
+ * Wake every waiting process
+ * @param  wq the wait queue
+ * @return    the number of processes woken
+ */
+uint32_t wake_up_all(kwait_queue_t* wq) {
+  uint32_t woken = 0;
+  uint64_t flags = kspin_lock_irqsave(&wq->lock);
+  while (wq->head != NULL) {
+    kpcb_t* pcb = wq->head;
+    kwait_remove(wq,pcb);
+    kschd_wake(pcb);
+    woken++;
+  }
+  kspin_unlock_irqrestore(&wq->lock,flags);
+  return woken;
+}
@@ -0,0 +1,84 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _SCHD_KWAIT_H
+#define _SCHD_KWAIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../smp/spinlock.h"
+
+struct kpcb_t;
+
+/*
+ * Processes blocked until an event, woken in the order they blocked
+ * Blocked processes sit here rather than on a run queue
+ */
+typedef struct kwait_queue_t {
+  kspinlock_t lock;
+  struct kpcb_t* head;
+  struct kpcb_t* tail;
+} kwait_queue_t;
+
+#define KWAIT_QUEUE_INIT {KSPINLOCK_INIT, NULL, NULL}
+
+/**
+ * Block the current process until a condition holds
+ * The condition is checked after queueing, so a wakeup between the
+ * check and blocking is not lost; it is rechecked after every wakeup
+ * @param wq   the wait queue (kwait_queue_t*) woken when it may hold
+ * @param cond the condition, evaluated in the caller
+ */
+#define wait_event(wq, cond)        \
+  do {                              \
+    while (!(cond)) {               \
+      kwait_prepare(wq);            \
+      if (!(cond)) {                \
+        kwait_block();              \
+      }                             \
+      kwait_finish(wq);             \
+    }                               \
+  } while (0)
+
+/**
+ * Initialize a wait queue
+ * @param wq the wait queue
+ */
+void init_kwait_queue(kwait_queue_t* wq);
+
+/**
+ * Add the current process to the tail of a wait queue, O(1)
+ * (no change if it is already there)
+ * @param wq the wait queue
+ */
+void kwait_prepare(kwait_queue_t* wq);
+
+/**
+ * Block the current process until it is woken
+ * Returns at once if it was woken since kwait_prepare()
+ */
+void kwait_block();
+
+/**
+ * Take the current process off a wait queue if a wakeup
+ * did not already, O(1)
+ * @param wq the wait queue
+ */
+void kwait_finish(kwait_queue_t* wq);
+
+/**
+ * Wake the process that has waited longest, O(1)
+ * @param  wq the wait queue
+ * @return    1 if a process was woken, 0 if none were waiting
+ */
+uint8_t wake_up_one(kwait_queue_t* wq);
+
+/**
+ * Wake every waiting process
+ * @param  wq the wait queue
+ * @return    the number of processes woken
+ */
+uint32_t wake_up_all(kwait_queue_t* wq);
+
+#endif /*_SCHD_KWAIT_H*/
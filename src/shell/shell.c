@@ -4,9 +4,282 @@
 
 #include "shell.h"
 #include "../display/console.h"
+#include "../uart/uart.h"
+#include "../uart/debug.h"
+#include "../kstdlib/kstdlib.h"
+#include "../mmu/mmu.h"
+#include "../mmu/kheap.h"
+#include "../schd/kschd.h"
+
+//longest command line
+#define SHELL_LINE_MAX 64
+//most words in a command line (command and args)
+#define SHELL_ARGS_MAX 4
+//time between checks for input (the uart fifo holds 16 characters)
+#define SHELL_POLL_MS 10
+
+/*
+ * A shell command
+ */
+typedef struct shell_cmd_t {
+  const char* name;
+  const char* help;
+  //called with the words of the line, returns 1 to exit the shell
+  uint8_t (*fn)(int argc, char **argv);
+} shell_cmd_t;
 
 void prompt() {
-  write_str(">");
+  uart_puts(">");
+}
+
+/**
+ * Write two strings as one console line
+ * @param a the first string
+ * @param b the second string
+ */
+static void shell_line(const char* a, const char* b) {
+  char line[2 * SHELL_LINE_MAX];
+  uint32_t a_len = strlen(a);
+  uint32_t b_len = strlen(b);
+  if (a_len >= SHELL_LINE_MAX) {
+    a_len = SHELL_LINE_MAX - 1;
+  }
+  if (b_len >= SHELL_LINE_MAX) {
+    b_len = SHELL_LINE_MAX - 1;
+  }
+  memcpy(line,a,a_len);
+  memcpy(line + a_len,b,b_len);
+  line[a_len + b_len] = 0;
+  write_strln(line);
+}
+
+/**
+ * Write a named value to the console
+ * @param name the name
+ * @param val  the value
+ */
+static void shell_val(const char* name, uint64_t val) {
+  char label[SHELL_LINE_MAX];
+  uint32_t len = strlen(name);
+  if (len > (SHELL_LINE_MAX - 3)) {
+    len = SHELL_LINE_MAX - 3;
+  }
+  memcpy(label,name,len);
+  memcpy(label + len,": ",3);
+
+  char num[24];
+  itoa(val,num);
+  shell_line(label,num);
+}
+
+/**
+ * Show kernel heap counters (full dump over uart)
+ * @return 0
+ */
+static uint8_t cmd_kheap(int argc, char **argv) {
+  (void) argc;
+  (void) argv;
+  kheap_stats_t stats;
+  kheap_get_stats(&stats);
+
+  shell_val("live",stats.live);
+  shell_val("peak",stats.peak);
+  shell_val("cap",stats.cap);
+  shell_val("free",stats.free);
+  shell_val("free blocks",stats.free_blocks);
+  shell_val("largest free",stats.largest_free);
+  shell_val("frag pct",stats.frag_pct);
+  shell_val("allocs",stats.allocs);
+  shell_val("frees",stats.frees);
+  if (stats.allocs > 0) {
+    shell_val("alloc cycles avg",stats.alloc_cycles / stats.allocs);
+  }
+  if (stats.frees > 0) {
+    shell_val("free cycles avg",stats.free_cycles / stats.frees);
+  }
+  debug_kheap();
+  return 0;
+}
+
+/**
+ * Show page allocator counters (full dump over uart)
+ * @return 0
+ */
+static uint8_t cmd_mem(int argc, char **argv) {
+  (void) argc;
+  (void) argv;
+  palloc_stats_t stats;
+  palloc_get_stats(&stats);
+
+  shell_val("pages total",stats.pages_total);
+  shell_val("pages free",stats.pages_free);
+  shell_val("pages pooled",stats.pages_pooled);
+  shell_val("pages used",stats.pages_used);
+  shell_val("pages peak",stats.pages_peak);
+  shell_val("largest order",stats.largest_order);
+  shell_val("frag pct",stats.frag_pct);
+  shell_val("palloc calls",stats.allocs);
+  shell_val("pfree calls",stats.frees);
+  shell_val("palloc fails",stats.fails);
+  debug_mmu();
+  return 0;
+}
+
+/**
+ * Show per core scheduler counters
+ * @return 0
+ */
+static uint8_t cmd_cpus(int argc, char **argv) {
+  (void) argc;
+  (void) argv;
+  kschd_cpu_stats_t stats;
+  for (uint8_t core=0; kschd_get_cpu_stats(core,&stats) == 0; core++) {
+    shell_val("core",core);
+    if (!stats.online) {
+      write_strln(" offline");
+      continue;
+    }
+    shell_val(" queued",stats.queued);
+    shell_val(" switches",stats.switches);
+    shell_val(" steals",stats.steals);
+    shell_val(" stolen",stats.stolen);
+    shell_val(" migrations",stats.migrations);
+    shell_val(" ticks",stats.ticks);
+    shell_val(" idle us",stats.idle_us);
+  }
+  return 0;
+}
+
+/**
+ * Show the scheduling parameters, or set one
+ * sched [name value]
+ * @return 0
+ */
+static uint8_t cmd_sched(int argc, char **argv) {
+  kschd_tunables_t tune;
+  kschd_get_tunables(&tune);
+
+  const char* names[] = {"slice_high", "slice_med", "slice_low",
+                         "boost_after", "decay_after",
+                         "period_ms", "min_slice_ms"};
+  uint32_t* fields[] = {&tune.slice_ms[0], &tune.slice_ms[1], &tune.slice_ms[2],
+                        &tune.boost_after, &tune.decay_after,
+                        &tune.period_ms, &tune.min_slice_ms};
+  const uint32_t count = sizeof(names) / sizeof(names[0]);
+
+  if (argc == 3) {
+    uint32_t i = 0;
+    while ((i < count) && strcmp(names[i],argv[1])) {
+      i++;
+    }
+    uint64_t val;
+    if ((i == count) || strtou(argv[2],&val) || (val > 0xFFFFFFFF)) {
+      write_strln("usage: sched [name value]");
+      return 0;
+    }
+    *fields[i] = val;
+    if (kschd_set_tunables(&tune)) {
+      write_strln("value out of range");
+      kschd_get_tunables(&tune);
+    }
+  } else if (argc != 1) {
+    write_strln("usage: sched [name value]");
+    return 0;
+  }
+
+  for (uint32_t i=0; i<count; i++) {
+    shell_val(names[i],*fields[i]);
+  }
+  return 0;
+}
+
+/**
+ * Leave the shell
+ * @return 1
+ */
+static uint8_t cmd_exit(int argc, char **argv) {
+  (void) argc;
+  (void) argv;
+  return 1;
+}
+
+static uint8_t cmd_help(int argc, char **argv);
+
+//available commands
+const shell_cmd_t SHELL_CMDS[] = {
+  {"help", " - list commands", cmd_help},
+  {"kheap", " - kernel heap counters", cmd_kheap},
+  {"mem", " - page allocator counters", cmd_mem},
+  {"cpus", " - per core scheduler counters", cmd_cpus},
+  {"sched", " [name value] - show or set scheduling parameters", cmd_sched},
+  {"exit", " - leave the shell", cmd_exit},
+};
+
+#define SHELL_CMDS_COUNT (sizeof(SHELL_CMDS) / sizeof(shell_cmd_t))
+
+/**
+ * List commands
+ * @return 0
+ */
+static uint8_t cmd_help(int argc, char **argv) {
+  (void) argc;
+  (void) argv;
+  for (uint32_t i=0; i<SHELL_CMDS_COUNT; i++) {
+    shell_line(SHELL_CMDS[i].name,SHELL_CMDS[i].help);
+  }
+  return 0;
+}
+
+/**
+ * Read a line from uart (echoed)
+ * @param line the line (set, null terminated)
+ */
+static void read_line(char *line) {
+  uint32_t len = 0;
+  while (1) {
+    //sleep while there is no input so the core can idle, ending
+    //slices early keeps the shell at a boosted priority
+    while (!uart_rx_ready()) {
+      kthread_sleep_ms(SHELL_POLL_MS);
+    }
+    unsigned char c = uart_getc();
+    if ((c == '\r') || (c == '\n')) {
+      uart_puts("\n");
+      break;
+    } else if ((c == 0x7F) || (c == '\b')) {
+      if (len > 0) {
+        len--;
+        uart_puts("\b \b");
+      }
+    } else if ((len < (SHELL_LINE_MAX - 1)) && (c >= ' ')) {
+      line[len++] = c;
+      uart_putc(c);
+    }
+  }
+  line[len] = 0;
+}
+
+/**
+ * Split a line into words at spaces (in place)
+ * @param  line the line (words are null terminated)
+ * @param  argv the words (set)
+ * @return      the number of words, at most SHELL_ARGS_MAX (extra are ignored)
+ */
+static int split_line(char *line, char **argv) {
+  int argc = 0;
+  while (*line != 0) {
+    while (*line == ' ') {
+      *line++ = 0;
+    }
+    if ((*line == 0) || (argc == SHELL_ARGS_MAX)) {
+      break;
+    }
+    argv[argc++] = line;
+    while ((*line != 0) && (*line != ' ')) {
+      line++;
+    }
+  }
+  return argc;
 }
 
 /**
@@ -18,4 +291,29 @@ void prompt() {
 int shell_main(int argc, char **argv) {
   write_strln("aarch64 kernel mode");
   write_strln("starting kernel shell");
+
+  char line[SHELL_LINE_MAX];
+  while (1) {
+    prompt();
+    read_line(line);
+    shell_line(">",line);
+
+    char *args[SHELL_ARGS_MAX];
+    int nargs = split_line(line,args);
+    if (nargs == 0) {
+      continue;
+    }
+
+    uint32_t i = 0;
+    while ((i < SHELL_CMDS_COUNT) && strcmp(SHELL_CMDS[i].name,args[0])) {
+      i++;
+    }
+
+    if (i == SHELL_CMDS_COUNT) {
+      write_strln("unknown command (try help)");
+    } else if (SHELL_CMDS[i].fn(nargs,args)) {
+      break;
+    }
+  }
+  return 0;
 }
@@ -0,0 +1,93 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "smp.h"
+#include "../mmu/mmu.h"
+#include "../irq/irq.h"
+#include "../schd/kschd.h"
+#include "../timer/timer.h"
+#include "../uart/debug.h"
+
+//spin table release addresses, one word per core
+//(armstub8 and qemu raspi3 park the secondary cores polling these)
+#define SPIN_TABLE_BASE 0xd8
+
+//time a core gets to come up before it is left parked
+#define SMP_BOOT_TIMEOUT_US 100000
+
+//where each core starts, defined in boot.S
+void secondary_entry();
+
+//top of each core's boot stack, read by boot.S with the mmu off
+uint64_t SMP_BOOT_STACKS[SMP_CORES];
+
+//set by each secondary core once its mmu is on
+volatile uint8_t SMP_CORE_ONLINE[SMP_CORES];
+
+/**
+ * Get the id of the calling core
+ * @return the core id (0 is the boot core)
+ */
+uint8_t get_core_id() {
+  uint64_t mpidr;
+  asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+  return (uint8_t) (mpidr & (SMP_CORES - 1));
+}
+
+/**
+ * Release the secondary cores from the spin table and wait
+ * for each to come up with the mmu on
+ * Each core enters the scheduler through kschd_start_secondary()
+ * @return the number of cores running, including this one
+ */
+uint8_t smp_start_cores() {
+  uint8_t running = 1;
+
+  for (uint8_t core=1; core<SMP_CORES; core++) {
+    //never freed, the core's idle process keeps running on it
+    void *stack = palloc_nozero();
+    if (stack == NULL) {
+      debug_err("unable to allocate boot stack");
+      continue;
+    }
+    SMP_BOOT_STACKS[core] = (uint64_t) stack + THREAD_SIZE;
+
+    //the core runs with its caches off until it enables the mmu,
+    //so everything it touches before then must be in memory
+    dcache_flush_range(stack,THREAD_SIZE);
+    dcache_flush_range(&SMP_BOOT_STACKS[core],sizeof(uint64_t));
+
+    uint64_t addr = SPIN_TABLE_BASE + (8 * core);
+    uint64_t *release = (uint64_t*) addr;
+    *release = (uint64_t) secondary_entry;
+    dcache_flush_range(release,sizeof(uint64_t));
+    asm volatile("sev");
+
+    uint64_t start = get_sys_count();
+    while (!SMP_CORE_ONLINE[core] &&
+           (ticks_to_us(get_sys_count() - start) < SMP_BOOT_TIMEOUT_US)) {}
+
+    if (SMP_CORE_ONLINE[core]) {
+      running++;
+    } else {
+      debug_val("core did not start",core);
+    }
+  }
+  return running;
+}
+
+/**
+ * Entry for a secondary core once it reaches EL1 on its boot stack
+ * (called from boot.S, no return)
+ * @param core the core id
+ */
+void secondary_init(uint64_t core) {
+  mmu_enable_core();
+  init_irq();
+  //PMCCNTR_EL0 is per core, threads placed here read it too
+  init_cycle_count();
+  SMP_CORE_ONLINE[core] = 1;
+
+  kschd_start_secondary();
+}
@@ -0,0 +1,35 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _SMP_SMP_H
+#define _SMP_SMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//cores on the BCM2837
+#define SMP_CORES 4
+
+/**
+ * Get the id of the calling core
+ * @return the core id (0 is the boot core)
+ */
+uint8_t get_core_id();
+
+/**
+ * Release the secondary cores from the spin table and wait
+ * for each to come up with the mmu on
+ * Each core enters the scheduler through kschd_start_secondary()
+ * @return the number of cores running, including this one
+ */
+uint8_t smp_start_cores();
+
+/**
+ * Entry for a secondary core once it reaches EL1 on its boot stack
+ * (called from boot.S, no return)
+ * @param core the core id
+ */
+void secondary_init(uint64_t core);
+
+#endif /*_SMP_SMP_H*/
@@ -0,0 +1,104 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "spinlock.h"
+#include "../irq/irq.h"
+
+//exclusives are only reliable on normal cacheable memory (mmu on),
+//until then only the boot core runs and locks are plain flags
+uint8_t KSPIN_EXCLUSIVE = 0;
+
+/**
+ * Switch locks to load/store exclusives
+ * Called by the boot core once its mmu and caches are on,
+ * before any other core starts
+ */
+void kspin_use_exclusives() {
+  KSPIN_EXCLUSIVE = 1;
+}
+
+/**
+ * Acquire a lock
+ * @param lock the lock
+ */
+void kspin_lock(kspinlock_t *lock) {
+  if (!KSPIN_EXCLUSIVE) {
+    lock->locked = 1;
+    return;
+  }
+
+  uint32_t tmp;
+  //exclusives rather than __atomic builtins, which may need libgcc
+  //the release store in kspin_unlock clears the monitor and wakes wfe
+  asm volatile("sevl\n"
+               "1: wfe\n"
+               "2: ldaxr %w0, [%1]\n"
+               "cbnz %w0, 1b\n"
+               "stxr %w0, %w2, [%1]\n"
+               "cbnz %w0, 2b"
+               : "=&r"(tmp) : "r"(&lock->locked), "r"(1) : "memory");
+}
+
+/**
+ * Acquire a lock if it is free
+ * @param  lock the lock
+ * @return      1 if acquired, 0 if held
+ */
+uint8_t kspin_trylock(kspinlock_t *lock) {
+  if (!KSPIN_EXCLUSIVE) {
+    //still reports a lock held further up the same path
+    if (lock->locked) {
+      return 0;
+    }
+    lock->locked = 1;
+    return 1;
+  }
+
+  uint32_t tmp;
+  asm volatile("1: ldaxr %w0, [%1]\n"
+               "cbnz %w0, 2f\n"
+               "stxr %w0, %w2, [%1]\n"
+               "cbnz %w0, 1b\n"
+               "b 3f\n"
+               "2: clrex\n"
+               "3:"
+               : "=&r"(tmp) : "r"(&lock->locked), "r"(1) : "memory");
+  //tmp is 0 only after a successful store
+  return tmp == 0;
+}
+
+/**
+ * Release a lock
+ * @param lock the lock
+ */
+void kspin_unlock(kspinlock_t *lock) {
+  if (!KSPIN_EXCLUSIVE) {
+    lock->locked = 0;
+    return;
+  }
+  asm volatile("stlr wzr, [%0]" :: "r"(&lock->locked) : "memory");
+}
+
+/**
+ * Mask irqs on this core and acquire a lock
+ * For locks also taken from the irq handler or held across
+ * code that must not be preempted
+ * @param  lock the lock
+ * @return      the irq state to restore
+ */
+uint64_t kspin_lock_irqsave(kspinlock_t *lock) {
+  uint64_t flags = irq_save();
+  kspin_lock(lock);
+  return flags;
+}
+
+/**
+ * Release a lock and restore the irq state
+ * @param lock  the lock
+ * @param flags the state returned by kspin_lock_irqsave()
+ */
+void kspin_unlock_irqrestore(kspinlock_t *lock, uint64_t flags) {
+  kspin_unlock(lock);
+  irq_restore(flags);
+}
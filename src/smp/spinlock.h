@@ -0,0 +1,63 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _SMP_SPINLOCK_H
+#define _SMP_SPINLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A test and set spinlock (zero is unlocked)
+ * Waiters sleep in wfe until the holder releases
+ */
+typedef struct kspinlock_t {
+  volatile uint32_t locked;
+} kspinlock_t;
+
+#define KSPINLOCK_INIT {0}
+
+/**
+ * Switch locks to load/store exclusives
+ * Called by the boot core once its mmu and caches are on,
+ * before any other core starts
+ */
+void kspin_use_exclusives();
+
+/**
+ * Acquire a lock
+ * @param lock the lock
+ */
+void kspin_lock(kspinlock_t *lock);
+
+/**
+ * Acquire a lock if it is free
+ * @param  lock the lock
+ * @return      1 if acquired, 0 if held
+ */
+uint8_t kspin_trylock(kspinlock_t *lock);
+
+/**
+ * Release a lock
+ * @param lock the lock
+ */
+void kspin_unlock(kspinlock_t *lock);
+
+/**
+ * Mask irqs on this core and acquire a lock
+ * For locks also taken from the irq handler or held across
+ * code that must not be preempted
+ * @param  lock the lock
+ * @return      the irq state to restore
+ */
+uint64_t kspin_lock_irqsave(kspinlock_t *lock);
+
+/**
+ * Release a lock and restore the irq state
+ * @param lock  the lock
+ * @param flags the state returned by kspin_lock_irqsave()
+ */
+void kspin_unlock_irqrestore(kspinlock_t *lock, uint64_t flags);
+
+#endif /*_SMP_SPINLOCK_H*/
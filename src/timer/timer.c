@@ -0,0 +1,183 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "timer.h"
+#include "../smp/smp.h"
+
+//PMCR_EL0 enable and cycle counter reset
+#define PMCR_E (1UL << 0)
+#define PMCR_C (1UL << 2)
+//PMCNTENSET_EL0 cycle counter enable
+#define PMCNTEN_C (1UL << 31)
+
+//CNTP_CTL_EL0 enable (interrupt unmasked)
+#define CNTP_CTL_ENABLE (1UL << 0)
+
+//timer interrupt routing (BCM2836 local peripherals, 4 bytes per core)
+#define CORE0_TIMER_IRQCNTL 0x40000040
+//route the non-secure physical timer to irq
+#define TIMER_IRQ_CNTPNS    (1 << 1)
+
+//how each core's timer is programmed
+#define TICK_MODE_PERIODIC 0
+#define TICK_MODE_ONESHOT  1
+#define TICK_MODE_STOPPED  2
+
+//counter ticks between scheduler ticks
+uint64_t TICK_INTERVAL = 0;
+//counter value of the next scheduler tick on each core
+uint64_t TICK_NEXT[SMP_CORES];
+//counter value of the last tick (or when the timer was programmed)
+uint64_t TICK_LAST[SMP_CORES];
+uint8_t TICK_MODE[SMP_CORES];
+
+/**
+ * Program this core's timer compare value and enable it
+ * Writing a future compare value clears the interrupt condition
+ * @param core this core
+ * @param cval the counter value to interrupt at
+ */
+static inline void tick_program(uint8_t core, uint64_t cval) {
+  TICK_NEXT[core] = cval;
+  asm volatile("msr cntp_cval_el0, %0" :: "r"(cval));
+  asm volatile("msr cntp_ctl_el0, %0" :: "r"(CNTP_CTL_ENABLE));
+}
+
+/**
+ * Read the system counter
+ * @return the current counter value in ticks
+ */
+uint64_t get_sys_count() {
+  uint64_t count;
+  //isb so the read is not speculated ahead of earlier instructions
+  asm volatile("isb; mrs %0, cntpct_el0" : "=r"(count) :: "memory");
+  return count;
+}
+
+/**
+ * Get the frequency of the system counter
+ * @return ticks per second
+ */
+uint64_t get_sys_freq() {
+  uint64_t freq;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+  return freq;
+}
+
+/**
+ * Convert a number of counter ticks to microseconds
+ * @param  ticks the number of ticks
+ * @return       microseconds
+ */
+uint64_t ticks_to_us(uint64_t ticks) {
+  uint64_t freq = get_sys_freq();
+  if (freq == 0) {
+    return 0;
+  }
+  return (ticks * 1000000) / freq;
+}
+
+/**
+ * Start the cpu cycle counter (PMCCNTR_EL0)
+ */
+void init_cycle_count() {
+  uint64_t pmcr;
+  asm volatile("mrs %0, pmcr_el0" : "=r"(pmcr));
+  asm volatile("msr pmcr_el0, %0" :: "r"(pmcr | PMCR_E | PMCR_C));
+  asm volatile("msr pmcntenset_el0, %0" :: "r"(PMCNTEN_C));
+  asm volatile("isb");
+}
+
+/**
+ * Read the cpu cycle counter
+ * @return cycles since the counter was started
+ */
+uint64_t get_cycle_count() {
+  uint64_t cycles;
+  asm volatile("mrs %0, pmccntr_el0" : "=r"(cycles));
+  return cycles;
+}
+
+/**
+ * Start the periodic tick on this core's EL1 physical timer (CNTP)
+ * and route its interrupt to this core
+ * @param hz ticks per second
+ */
+void init_timer_tick(uint64_t hz) {
+  uint8_t core = get_core_id();
+  TICK_INTERVAL = get_sys_freq() / hz;
+  TICK_LAST[core] = get_sys_count();
+  TICK_MODE[core] = TICK_MODE_PERIODIC;
+  tick_program(core,TICK_LAST[core] + TICK_INTERVAL);
+
+  uint64_t reg = CORE0_TIMER_IRQCNTL + (4 * core);
+  *(volatile uint32_t*) reg = TIMER_IRQ_CNTPNS;
+}
+
+/**
+ * Acknowledge a tick interrupt and program the next one
+ * a tick later (until the scheduler picks another mode)
+ * @return the ticks elapsed since the previous tick or since the
+ *         timer was programmed, at least 1
+ */
+uint64_t timer_tick_ack() {
+  //deadlines advance from the last one so ticks do not drift,
+  //skipping any that were missed while irqs were masked
+  uint8_t core = get_core_id();
+  uint64_t now = get_sys_count();
+  uint64_t elapsed = (now - TICK_LAST[core]) / TICK_INTERVAL;
+  if (elapsed == 0) {
+    elapsed = 1;
+  }
+  TICK_LAST[core] += elapsed * TICK_INTERVAL;
+  TICK_MODE[core] = TICK_MODE_PERIODIC;
+  tick_program(core,TICK_LAST[core] + TICK_INTERVAL);
+  return elapsed;
+}
+
+/**
+ * Tick periodically on this core (no change if already ticking)
+ */
+void timer_tick_periodic() {
+  uint8_t core = get_core_id();
+  if (TICK_MODE[core] == TICK_MODE_PERIODIC) {
+    return;
+  }
+  //ticks count from now, time since the one shot was programmed
+  //belongs to the slice that has already ended
+  TICK_LAST[core] = get_sys_count();
+  TICK_MODE[core] = TICK_MODE_PERIODIC;
+  tick_program(core,TICK_LAST[core] + TICK_INTERVAL);
+}
+
+/**
+ * Stop the periodic tick on this core and interrupt once
+ * @param deadline the system count to interrupt at
+ */
+void timer_tick_oneshot(uint64_t deadline) {
+  uint8_t core = get_core_id();
+  TICK_LAST[core] = get_sys_count();
+  TICK_MODE[core] = TICK_MODE_ONESHOT;
+  //a deadline already passed interrupts at once
+  tick_program(core,deadline);
+}
+
+/**
+ * Get the system count a number of ticks from now
+ * @param  ticks the ticks
+ * @return       the count
+ */
+uint64_t timer_tick_deadline(uint64_t ticks) {
+  return get_sys_count() + (ticks * TICK_INTERVAL);
+}
+
+/**
+ * Stop this core's timer interrupts until the tick is restarted
+ */
+void timer_tick_stop() {
+  uint8_t core = get_core_id();
+  TICK_MODE[core] = TICK_MODE_STOPPED;
+  //a disabled timer does not assert its interrupt
+  asm volatile("msr cntp_ctl_el0, %0" :: "r"(0UL));
+}
@@ -0,0 +1,84 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _TIMER_TIMER_H
+#define _TIMER_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//scheduler tick rate (make HZ=n)
+#ifndef KTIMER_HZ
+#define KTIMER_HZ 1000
+#endif
+
+/**
+ * Read the system counter
+ * @return the current counter value in ticks
+ */
+uint64_t get_sys_count();
+
+/**
+ * Get the frequency of the system counter
+ * @return ticks per second
+ */
+uint64_t get_sys_freq();
+
+/**
+ * Convert a number of counter ticks to microseconds
+ * @param  ticks the number of ticks
+ * @return       microseconds
+ */
+uint64_t ticks_to_us(uint64_t ticks);
+
+/**
+ * Start the cpu cycle counter (PMCCNTR_EL0)
+ */
+void init_cycle_count();
+
+/**
+ * Read the cpu cycle counter
+ * @return cycles since the counter was started
+ */
+uint64_t get_cycle_count();
+
+/**
+ * Start the periodic tick on this core's EL1 physical timer (CNTP)
+ * and route its interrupt to this core
+ * @param hz ticks per second
+ */
+void init_timer_tick(uint64_t hz);
+
+/**
+ * Acknowledge a tick interrupt and program the next one
+ * a tick later (until the scheduler picks another mode)
+ * @return the ticks elapsed since the previous tick or since the
+ *         timer was programmed, at least 1
+ */
+uint64_t timer_tick_ack();
+
+/**
+ * Tick periodically on this core (no change if already ticking)
+ */
+void timer_tick_periodic();
+
+/**
+ * Stop the periodic tick on this core and interrupt once
+ * @param deadline the system count to interrupt at
+ */
+void timer_tick_oneshot(uint64_t deadline);
+
+/**
+ * Get the system count a number of ticks from now
+ * @param  ticks the ticks
+ * @return       the count
+ */
+uint64_t timer_tick_deadline(uint64_t ticks);
+
+/**
+ * Stop this core's timer interrupts until the tick is restarted
+ */
+void timer_tick_stop();
+
+#endif /*_TIMER_TIMER_H*/
@@ -37,7 +37,7 @@ void itoa(uint64_t num, char *buff) {
   while (1) {
     rem = num % 10;
     temp[i] = rem + '0';
-    if (num > 10) {
+    if (num >= 10) {
       num /= 10;
       i--;
     } else {
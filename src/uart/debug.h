@@ -12,6 +12,8 @@
 #define ERRNO_PALLOC 1
 //error calling kmalloc (space)
 #define ERRNO_KMALLOC 2
+//error building translation tables
+#define ERRNO_MMU 3
 
 /**
  * Log a message
@@ -32,6 +34,14 @@ void debug_err(const char* msg);
  */
 void debug_val(const char* name, uint64_t val);
 
+/**
+ * Convert an int to a string
+ * (Base 10)
+ * @param num  the number to convert
+ * @param buff the buffer (at least 21 bytes)
+ */
+void itoa(uint64_t num, char *buff);
+
 /**
  * Set the errno
  * @param code exit code
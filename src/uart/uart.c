@@ -93,6 +93,10 @@ unsigned char uart_getc() {
     return mmio_read(UART0_DR);
 }
 
+unsigned char uart_rx_ready() {
+    return !(mmio_read(UART0_FR) & (1 << 4));
+}
+
 void uart_puts(const char* str) {
     for (size_t i = 0; str[i] != '\0'; i ++)
         uart_putc((unsigned char)str[i]);
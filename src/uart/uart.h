@@ -22,6 +22,12 @@ void uart_putc(unsigned char c);
  */
 unsigned char uart_getc();
 
+/**
+ * Check for a received character without waiting
+ * @return 1 if uart_getc() would return at once
+ */
+unsigned char uart_rx_ready();
+
 /**
  * Put a string
  * @param str the string
@@ -0,0 +1,39 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "khost.h"
+#include "../../src/uart/debug.h"
+#include "../../src/mmu/kbench.h"
+#include "../../src/mmu/kheap.h"
+#include "../../src/mmu/mmu.h"
+
+//operations per benchmark unless given
+#define KHOST_BENCH_OPS 1000000
+
+/**
+ * Run the KBENCH allocator benchmarks natively
+ * usage: kbench_host [ops] [seed]
+ * @return 0 if every allocation succeeded and was intact
+ */
+int main(int argc, char **argv) {
+  uint64_t ops = khost_arg(argc,argv,1,KHOST_BENCH_OPS);
+  uint64_t seed = khost_arg(argc,argv,2,1);
+  if (seed == 0) {
+    seed = 1;
+  }
+
+  if (khost_init(KHOST_RAM_SIZE)) {
+    return 1;
+  }
+
+  uint8_t status = kbench_kheap(ops,seed);
+  status |= kbench_palloc(ops,seed);
+  debug_kheap();
+  debug_mmu();
+
+  if (status) {
+    debug_err("kbench failed");
+  }
+  return status;
+}
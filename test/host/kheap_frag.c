@@ -0,0 +1,162 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include "khost.h"
+#include "../../src/uart/debug.h"
+#include "../../src/mmu/kheap.h"
+#include "../../src/mmu/mmu.h"
+
+//random alloc/free operations unless given
+#define KFRAG_OPS 4000000
+//live allocations at any time
+#define KFRAG_SLOTS 8192
+//largest kmalloc size as a power of two (below the large threshold)
+#define KFRAG_MAX_SHIFT 12
+//fragmentation snapshots per run
+#define KFRAG_TRACE_POINTS 16
+//heap memory allowed per byte at the live high-water mark
+#define KFRAG_CAP_RATIO 2
+//growth allowed after the first half of the run, percent
+#define KFRAG_LATE_GROWTH_PCT 10
+
+void* KFRAG_ALLOCS[KFRAG_SLOTS];
+uint64_t KFRAG_SIZES[KFRAG_SLOTS];
+
+/**
+ * Next value from a xorshift generator
+ * @param  state the generator state (updated)
+ * @return       the value
+ */
+static uint64_t frag_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+/**
+ * Check and free an allocation
+ * @param  slot the slot
+ * @return      0 if the allocation was intact, pos otherwise
+ */
+static uint8_t frag_free(uint64_t slot) {
+  uint8_t *memory = (uint8_t*) KFRAG_ALLOCS[slot];
+  uint8_t status = 0;
+  for (uint64_t i=0; i<KFRAG_SIZES[slot]; i++) {
+    if (memory[i] != (uint8_t) slot) {
+      status = 1;
+      break;
+    }
+  }
+  kfree(memory);
+  KFRAG_ALLOCS[slot] = NULL;
+  return status;
+}
+
+/**
+ * Log a heap fragmentation snapshot
+ * @param op    the operation number
+ * @param stats the counters (set)
+ */
+static void frag_trace(uint64_t op, kheap_stats_t *stats) {
+  kheap_get_stats(stats);
+  debug_val("trace op",op);
+  debug_val(" live",stats->live);
+  debug_val(" cap",stats->cap);
+  debug_val(" free_blocks",stats->free_blocks);
+  debug_val(" frag_pct",stats->frag_pct);
+}
+
+/**
+ * Stress kmalloc/kfree with random sizes and lifetimes and check
+ * that fragmentation stays bounded:
+ *  - heap memory stays within KFRAG_CAP_RATIO of the live high-water mark
+ *  - the heap stops growing once the workload reaches steady state
+ *  - freeing everything coalesces the heap back into one block
+ * usage: kheap_frag [ops] [seed]
+ * @return 0 on success, pos on failure
+ */
+int main(int argc, char **argv) {
+  uint64_t ops = khost_arg(argc,argv,1,KFRAG_OPS);
+  uint64_t seed = khost_arg(argc,argv,2,1);
+  if (seed == 0) {
+    seed = 1;
+  }
+
+  if (khost_init(KHOST_RAM_SIZE)) {
+    return 1;
+  }
+
+  debug_log("kheap fragmentation stress");
+  kheap_stats_t stats;
+  uint64_t errors = 0;
+  uint64_t half_cap = 0;
+
+  for (uint64_t op=0; op<ops; op++) {
+    if ((op % (ops / KFRAG_TRACE_POINTS + 1)) == 0) {
+      frag_trace(op,&stats);
+    }
+    if (op == ops / 2) {
+      kheap_get_stats(&stats);
+      half_cap = stats.cap;
+    }
+
+    uint64_t slot = frag_rand(&seed) % KFRAG_SLOTS;
+    if (KFRAG_ALLOCS[slot] != NULL) {
+      errors += frag_free(slot);
+      continue;
+    }
+
+    //sizes spread evenly over powers of two
+    uint64_t shift = frag_rand(&seed) % (KFRAG_MAX_SHIFT + 1);
+    uint64_t size = 1 + (frag_rand(&seed) % (1UL << shift));
+    uint8_t *memory = (uint8_t*) kmalloc(size);
+    if (memory == NULL) {
+      errors++;
+      continue;
+    }
+    memset(memory,(uint8_t) slot,size);
+    KFRAG_ALLOCS[slot] = memory;
+    KFRAG_SIZES[slot] = size;
+  }
+  frag_trace(ops,&stats);
+
+  uint8_t status = 0;
+  if (errors > 0) {
+    debug_val("kheap_frag errors",errors);
+    status = 1;
+  }
+  if (stats.cap > KFRAG_CAP_RATIO * stats.peak) {
+    debug_err("heap memory is unbounded by the live high-water mark");
+    status = 1;
+  }
+  if ((stats.cap - half_cap) * 100 > half_cap * KFRAG_LATE_GROWTH_PCT) {
+    debug_val("kheap_frag half cap",half_cap);
+    debug_err("heap kept growing after steady state");
+    status = 1;
+  }
+
+  //every block merges back once all are free
+  for (uint64_t slot=0; slot<KFRAG_SLOTS; slot++) {
+    if (KFRAG_ALLOCS[slot] != NULL) {
+      status |= frag_free(slot);
+    }
+  }
+  kheap_trim();
+  frag_trace(ops,&stats);
+  if ((stats.live != 0) || (stats.free_blocks != 1) ||
+      (stats.cap != K_HEAP_SIZE_B)) {
+    debug_err("heap did not coalesce after freeing everything");
+    status = 1;
+  }
+
+  if (status) {
+    debug_err("kheap_frag failed");
+  } else {
+    debug_log("kheap_frag passed");
+  }
+  return status;
+}
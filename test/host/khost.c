@@ -0,0 +1,241 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "khost.h"
+#include "../../src/uart/uart.h"
+#include "../../src/uart/debug.h"
+#include "../../src/timer/timer.h"
+#include "../../src/irq/irq.h"
+#include "../../src/smp/spinlock.h"
+#include "../../src/mmu/mmu.h"
+#include "../../src/mmu/kheap.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+//the end of the "kernel image" (linked with --defsym)
+extern uint8_t __end;
+
+/*
+ * Exit code on failure
+ */
+uint8_t ERRNO = 0;
+
+/**
+ * Write a character to stdout in place of the uart
+ * @param c the character
+ */
+void uart_putc(unsigned char c) {
+  putchar(c);
+}
+
+/**
+ * Write a string to stdout in place of the uart
+ * @param str the null term string
+ */
+void uart_puts(const char* str) {
+  fputs(str,stdout);
+}
+
+/**
+ * Log a message
+ * @param msg the message to log
+ */
+void debug_log(const char* msg) {
+  printf("[LOG] %s\n",msg);
+}
+
+/**
+ * Log an error
+ * @param msg the error message
+ */
+void debug_err(const char* msg) {
+  printf("[ERR] %03u: %s\n",ERRNO,msg);
+}
+
+/**
+ * Debug some value
+ * @param name the identifier
+ * @param val  the value itself
+ */
+void debug_val(const char* name, uint64_t val) {
+  printf("[LOG] %s: %lu\n",name,val);
+}
+
+/**
+ * Set the errno
+ * @param code exit code
+ */
+void set_errno(uint8_t code) {
+  ERRNO = code;
+}
+
+/**
+ * Read the monotonic clock in place of the system counter
+ * @return the current count in ns
+ */
+uint64_t get_sys_count() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((uint64_t) ts.tv_sec * 1000000000UL) + ts.tv_nsec;
+}
+
+/**
+ * Get the frequency of the system counter
+ * @return ticks per second
+ */
+uint64_t get_sys_freq() {
+  return 1000000000UL;
+}
+
+/**
+ * Convert system counter ticks to microseconds
+ * @param  ticks the ticks (ns)
+ * @return       the microseconds
+ */
+uint64_t ticks_to_us(uint64_t ticks) {
+  return ticks / 1000;
+}
+
+/**
+ * The time stamp counter is always running
+ */
+void init_cycle_count() {
+}
+
+/**
+ * Read the time stamp counter in place of PMCCNTR_EL0
+ * @return the count
+ */
+uint64_t get_cycle_count() {
+  return __builtin_ia32_rdtsc();
+}
+
+/**
+ * The harness has no interrupts
+ * @return the irq state to restore
+ */
+uint64_t irq_save() {
+  return 0;
+}
+
+/**
+ * The harness has no interrupts
+ * @param flags the state returned by irq_save()
+ */
+void irq_restore(uint64_t flags) {
+  (void) flags;
+}
+
+/**
+ * The harness locks are plain flags either way
+ */
+void kspin_use_exclusives() {
+}
+
+/**
+ * Acquire a lock
+ * The harness is single threaded, a held lock would never be released
+ * @param lock the lock
+ */
+void kspin_lock(kspinlock_t *lock) {
+  if (lock->locked) {
+    debug_err("kspin_lock on a held lock (deadlock)");
+    abort();
+  }
+  lock->locked = 1;
+}
+
+/**
+ * Acquire a lock if it is free
+ * @param  lock the lock
+ * @return      1 if acquired, 0 if held
+ */
+uint8_t kspin_trylock(kspinlock_t *lock) {
+  if (lock->locked) {
+    return 0;
+  }
+  lock->locked = 1;
+  return 1;
+}
+
+/**
+ * Release a lock
+ * @param lock the lock
+ */
+void kspin_unlock(kspinlock_t *lock) {
+  if (!lock->locked) {
+    debug_err("kspin_unlock on a free lock");
+    abort();
+  }
+  lock->locked = 0;
+}
+
+/**
+ * Acquire a lock
+ * @param  lock the lock
+ * @return      the irq state to restore
+ */
+uint64_t kspin_lock_irqsave(kspinlock_t *lock) {
+  uint64_t flags = irq_save();
+  kspin_lock(lock);
+  return flags;
+}
+
+/**
+ * Release a lock
+ * @param lock  the lock
+ * @param flags the state returned by kspin_lock_irqsave()
+ */
+void kspin_unlock_irqrestore(kspinlock_t *lock, uint64_t flags) {
+  kspin_unlock(lock);
+  irq_restore(flags);
+}
+
+/**
+ * Map memory for the page allocator and initialize mmu and kheap
+ * as init() does on the board
+ * Memory below the link address __end is treated as the kernel image
+ * @param  ram_size the bytes of memory above __end
+ * @return          0 on success, pos on error
+ */
+uint8_t khost_init(uint64_t ram_size) {
+  //the allocators hand out physical addresses, so ram is identity
+  //mapped at the address it has on the board
+  void *ram = mmap(&__end,ram_size,PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,-1,0);
+  if (ram != (void*) &__end) {
+    debug_err("unable to map host ram at __end");
+    return 1;
+  }
+
+  uint64_t kheap_start = init_mmu((uint64_t) &__end + ram_size);
+  if (kheap_start <= 0) {
+    debug_err("init_mmu failed");
+    return 1;
+  }
+  init_kheap(kheap_start,K_HEAP_SIZE_B);
+  return 0;
+}
+
+/**
+ * Parse an optional numeric argument
+ * @param  argc the argument count
+ * @param  argv the arguments
+ * @param  idx  the argument index
+ * @param  def  the value if the argument is absent
+ * @return      the value
+ */
+uint64_t khost_arg(int argc, char **argv, int idx, uint64_t def) {
+  if (idx >= argc) {
+    return def;
+  }
+  return strtoull(argv[idx],NULL,0);
+}
@@ -0,0 +1,39 @@
+/*
+ * (C) Jack Hay, Apr 2021
+ */
+
+#ifndef _HOST_KHOST_H
+#define _HOST_KHOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Host (x86-64 Linux) harness for the allocators (make host-test)
+ * kheap.c, mmu.c and kstdlib.c are built natively with -DKHOST and the
+ * uart, timer, irq and spinlock functions they call are stubbed here
+ */
+
+//physical memory given to the page allocator by default
+#define KHOST_RAM_SIZE (64UL * 1024 * 1024)
+
+/**
+ * Map memory for the page allocator and initialize mmu and kheap
+ * as init() does on the board
+ * Memory below the link address __end is treated as the kernel image
+ * @param  ram_size the bytes of memory above __end
+ * @return          0 on success, pos on error
+ */
+uint8_t khost_init(uint64_t ram_size);
+
+/**
+ * Parse an optional numeric argument
+ * @param  argc the argument count
+ * @param  argv the arguments
+ * @param  idx  the argument index
+ * @param  def  the value if the argument is absent
+ * @return      the value
+ */
+uint64_t khost_arg(int argc, char **argv, int idx, uint64_t def);
+
+#endif /*_HOST_KHOST_H*/